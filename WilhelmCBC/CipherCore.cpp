@@ -0,0 +1,770 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for CipherCore class
+ */
+
+#include "CipherCore.h"
+
+#include <algorithm>	// std::min
+#include <cstring>		// std::memcpy, std::memcmp, std::memset, std::strcmp
+#include <cstdlib>		// std::getenv
+
+/* Byte substitution table (stolen from Rijndael) */
+alignas(64) static const unsigned char substitutionSingleChar[256] =
+{
+	0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+	0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+	0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+	0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+	0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+	0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+	0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+	0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+	0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+	0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+	0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+	0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+	0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+	0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+	0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+	0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+/* Two byte substitution table, substitutionSingleChar applied to both bytes of a 16 bit value.
+	Halves the number of dependent lookups per Feistel call. Built once at startup. */
+static struct SubstitutionDoubleChar {
+	alignas(64) uint16_t data[65536];
+	SubstitutionDoubleChar ()
+	{
+		for (unsigned int i = 0; i < 65536; i++)
+			data[i] = (uint16_t)(substitutionSingleChar[i & 0xFF] | (substitutionSingleChar[i >> 8] << 8));
+	}
+} substitutionDoubleChar;
+
+/************** Round schedule *************/
+/* The cipher's shape as template parameters: ROUNDS Feistel rounds, with rotations offset by ROTATE. Every engine
+ runs its rounds through UnrolledRounds, so each round is straight line code with its rotation counts as constants.
+ CipherCore instantiates them with FEISTEL_ROUNDS and ROR_CONSTANT. */
+
+// Right rotations of round roundNum: of the substituted side in feistel, and of the block key into the round key.
+//	Key rotations are taken modulo 64 as rorLRSide does, where 0 ORs the two halves together.
+template <unsigned int ROTATE> struct RoundRotations {
+	static constexpr unsigned int feistel (unsigned int roundNum) { return ROTATE+roundNum; }
+	static constexpr unsigned int key (unsigned int roundNum) { return ((roundNum*4+ROTATE+13)%(BLOCK_BITS/2)) & 63; }
+};
+
+// Round run at step of ROUNDS: encryption goes forwards, decryption backwards
+static constexpr unsigned int roundAt (bool encrypting, unsigned int rounds, unsigned int step)
+{
+	return encrypting ? step : rounds-1-step;
+}
+
+// Calls step.round<STEP>() for every STEP up to ROUNDS-1, in order, as straight line code
+template <unsigned int STEP, unsigned int ROUNDS> struct UnrolledRounds {
+	template <class Step> static inline void run (Step & step)
+	{
+		step.template round<STEP>();
+		UnrolledRounds<STEP+1, ROUNDS>::run(step);
+	}
+};
+template <unsigned int ROUNDS> struct UnrolledRounds<ROUNDS, ROUNDS> {
+	template <class Step> static inline void run (Step &) {}
+};
+
+/************** Scalar engine *************/
+
+// rorLRSide by a constant count
+template <unsigned int COUNT>
+static inline CipherCore::LRSide rotateSide (const CipherCore::LRSide & input)
+{
+	uint64_t words[2];
+	std::memcpy(words, &input.data[0], sizeof(words));
+
+	const uint64_t rotated[2] = {(words[0] >> (COUNT&63)) | (words[1] << ((64-COUNT)&63)),
+								 (words[1] >> (COUNT&63)) | (words[0] << ((64-COUNT)&63))};
+	CipherCore::LRSide result;
+	std::memcpy(&result.data[0], rotated, sizeof(rotated));
+	return result;
+}
+
+// Performs Feistel manipulation of baseDerivation, rotating by ROTATION, and ^='s it into the opposing side.
+template <unsigned int ROTATION>
+static inline void feistel (CipherCore::LRSide & opposingSide, const CipherCore::LRSide & baseDerivation, const CipherCore::LRSide & roundKey)
+{
+	// roundNum has maximum value of 16, so 16+27 is < 64, which is the range of values for which rorLRSide behaviors reasonably.
+	// In debugging I noticed a very strange convergence that happens with most vlaues of ROR_CONSTANT when roundNum is held constant, where repeated
+	//	runs of feistel function with the same input would converge to a single value. roundNum changes every run so it's not significant.
+	static_assert(ROTATION > 0 && ROTATION < 64, "feistel rotations must stay within one 64 bit half");
+
+	// Work on the side as two 64 bit halves held in registers, the same layout rorLRSide uses.
+	uint64_t side[2], key[2];
+	std::memcpy(side, &baseDerivation.data[0], sizeof(side));
+	std::memcpy(key, &roundKey.data[0], sizeof(key));
+	uint64_t low = side[0] ^ key[0];
+	uint64_t high = side[1] ^ key[1];
+
+	// Substitute two bytes at a time, reassembling the substituted halves in registers instead of a store and reload per byte.
+	uint64_t subLow = 0;
+	uint64_t subHigh = 0;
+	for (unsigned int shift = 0; shift < 64; shift += 16)
+	{
+		subLow |= (uint64_t)substitutionDoubleChar.data[(low >> shift) & 0xFFFF] << shift;
+		subHigh |= (uint64_t)substitutionDoubleChar.data[(high >> shift) & 0xFFFF] << shift;
+	}
+
+	// Same rotation as rorLRSide, fused with the substitution above and the xor into the opposing side.
+	uint64_t opposing[2];
+	std::memcpy(opposing, &opposingSide.data[0], sizeof(opposing));
+	opposing[0] ^= (subLow >> ROTATION) | (subHigh << (64-ROTATION));
+	opposing[1] ^= (subHigh >> ROTATION) | (subLow << (64-ROTATION));
+	std::memcpy(&opposingSide.data[0], opposing, sizeof(opposing));
+}
+
+// Round keys of one block key, one round per step
+template <unsigned int ROTATE> struct KeyRounds {
+	const CipherCore::LRSide & key;
+	CipherCore::LRSide * keys;
+
+	template <unsigned int ROUND> void round ()
+	{
+		keys[ROUND] = rotateSide<RoundRotations<ROTATE>::key(ROUND)>(key);
+	}
+};
+
+// count blocks with their expanded round keys, interleaved round by round so independent table lookups overlap
+template <bool ENCRYPTING, unsigned int ROUNDS, unsigned int ROTATE> struct ScalarRounds {
+	CipherCore::Block * const * blocks;
+	const CipherCore::LRSide (* keys)[ROUNDS];
+	std::size_t count;
+
+	template <unsigned int STEP> void round ()
+	{
+		const unsigned int roundNum = roundAt(ENCRYPTING, ROUNDS, STEP);
+		const unsigned int rotation = RoundRotations<ROTATE>::feistel(roundNum);
+
+		// Encryption sets the left side from the right first, decryption the right from the left
+		const unsigned int firstSide = ENCRYPTING ? 0 : 1;
+		for (std::size_t lane = 0; lane < count; lane++)
+		{
+			CipherCore::LRSide * sides = (CipherCore::LRSide *)&blocks[lane]->data[0];
+			feistel<rotation>(sides[firstSide], sides[1-firstSide], keys[lane][roundNum]);
+		}
+		for (std::size_t lane = 0; lane < count; lane++)
+		{
+			CipherCore::LRSide * sides = (CipherCore::LRSide *)&blocks[lane]->data[0];
+			feistel<rotation>(sides[1-firstSide], sides[firstSide], keys[lane][roundNum]);
+		}
+	}
+};
+
+/************** Vector lane engines *************/
+/* Many independent blocks through the Feistel rounds at once, see header. Each LRSide is one 128 bit lane,
+ the substitution is the AES S-box instruction, and rotations are 64 bit shifts of the side and its swapped halves. */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#  define CIPHERCORE_HAVE_VECTOR_LANES 1
+#  include <cpuid.h>
+#  include <immintrin.h>
+
+/* Right rotation of every side by COUNT, as rorLRSide does it: a count of 0 ORs the two halves together */
+template <unsigned int COUNT>
+__attribute__((target("aes,ssse3")))
+static inline __m128i rotateSides128 (__m128i sides)
+{
+	__m128i swapped = _mm_shuffle_epi32(sides, 0x4E);
+	if ((COUNT & 63) == 0)
+		return _mm_or_si128(sides, swapped);
+	return _mm_or_si128(_mm_srli_epi64(sides, COUNT & 63), _mm_slli_epi64(swapped, (64-COUNT) & 63));
+}
+
+/* feistel() on 1 side. aesenclast with a zero key is SubBytes after ShiftRows, so the bytes go through InvShiftRows first. */
+template <unsigned int ROTATION>
+__attribute__((target("aes,ssse3")))
+static inline __m128i feistel128 (__m128i side, __m128i roundKey)
+{
+	const __m128i invShiftRows = _mm_set_epi8(3, 6, 9, 12, 15, 2, 5, 8, 11, 14, 1, 4, 7, 10, 13, 0);
+	__m128i substituted = _mm_aesenclast_si128(_mm_shuffle_epi8(_mm_xor_si128(side, roundKey), invShiftRows), _mm_setzero_si128());
+	return rotateSides128<ROTATION>(substituted);
+}
+
+template <bool ENCRYPTING, unsigned int ROUNDS, unsigned int ROTATE> struct RoundsAESNI {
+	__m128i * left;
+	__m128i * right;
+	const __m128i * key;
+	std::size_t count;
+
+	template <unsigned int STEP>
+	__attribute__((target("aes,ssse3")))
+	void round ()
+	{
+		const unsigned int roundNum = roundAt(ENCRYPTING, ROUNDS, STEP);
+		__m128i roundKey[8];	// count is at most lanesAESNI's 8
+		for (std::size_t lane = 0; lane < count; lane++)
+			roundKey[lane] = rotateSides128<RoundRotations<ROTATE>::key(roundNum)>(key[lane]);
+
+		// Sides in the order ScalarRounds updates them
+		__m128i * firstSide = ENCRYPTING ? left : right;
+		__m128i * secondSide = ENCRYPTING ? right : left;
+		for (std::size_t lane = 0; lane < count; lane++)
+			firstSide[lane] = _mm_xor_si128(firstSide[lane], feistel128<RoundRotations<ROTATE>::feistel(roundNum)>(secondSide[lane], roundKey[lane]));
+		for (std::size_t lane = 0; lane < count; lane++)
+			secondSide[lane] = _mm_xor_si128(secondSide[lane], feistel128<RoundRotations<ROTATE>::feistel(roundNum)>(firstSide[lane], roundKey[lane]));
+	}
+};
+
+/* 8 lanes, interleaved to cover the aesenclast latency */
+template <bool ENCRYPTING, unsigned int ROUNDS, unsigned int ROTATE>
+__attribute__((target("aes,ssse3")))
+static void lanesAESNI (CipherCore::Block * const * blocks, const CipherCore::LRSide * blockKeys, std::size_t laneCount)
+{
+	const std::size_t LANES = 8;
+
+	for (std::size_t first = 0; first < laneCount; first += LANES)
+	{
+		std::size_t count = std::min(LANES, laneCount-first);
+		__m128i left[LANES], right[LANES], key[LANES];
+		for (std::size_t lane = 0; lane < count; lane++)
+		{
+			left[lane] = _mm_loadu_si128((const __m128i *)&blocks[first+lane]->data[0]);
+			right[lane] = _mm_loadu_si128((const __m128i *)&blocks[first+lane]->data[BLOCK_BYTES/2]);
+			key[lane] = _mm_loadu_si128((const __m128i *)&blockKeys[first+lane].data[0]);
+		}
+
+		RoundsAESNI<ENCRYPTING, ROUNDS, ROTATE> rounds = {left, right, key, count};
+		UnrolledRounds<0, ROUNDS>::run(rounds);
+
+		for (std::size_t lane = 0; lane < count; lane++)
+		{
+			_mm_storeu_si128((__m128i *)&blocks[first+lane]->data[0], left[lane]);
+			_mm_storeu_si128((__m128i *)&blocks[first+lane]->data[BLOCK_BYTES/2], right[lane]);
+		}
+	}
+}
+
+static void lanesAESNI (bool encrypting, CipherCore::Block * const * blocks, const CipherCore::LRSide * blockKeys, std::size_t laneCount)
+{
+	if (encrypting)
+		lanesAESNI<true, FEISTEL_ROUNDS, ROR_CONSTANT>(blocks, blockKeys, laneCount);
+	else
+		lanesAESNI<false, FEISTEL_ROUNDS, ROR_CONSTANT>(blocks, blockKeys, laneCount);
+}
+
+/* rotateSides128 on 4 sides. The zero masking forms with every lane set are the plain instructions,
+ without GCC's uninitialized pass-through warnings. */
+template <unsigned int COUNT>
+__attribute__((target("avx512f,avx512bw,gfni")))
+static inline __m512i rotateSides512 (__m512i sides)
+{
+	__m512i swapped = _mm512_maskz_shuffle_epi32(0xFFFF, sides, _MM_PERM_BADC);
+	if ((COUNT & 63) == 0)
+		return _mm512_or_si512(sides, swapped);
+	return _mm512_or_si512(_mm512_maskz_srli_epi64(0xFF, sides, COUNT & 63), _mm512_maskz_slli_epi64(0xFF, swapped, (64-COUNT) & 63));
+}
+
+/* feistel() on 4 sides. The GFNI affine inverse with the AES matrix and constant is the Rijndael S-box. */
+template <unsigned int ROTATION>
+__attribute__((target("avx512f,avx512bw,gfni")))
+static inline __m512i feistel512 (__m512i side, __m512i roundKey)
+{
+	__m512i substituted = _mm512_gf2p8affineinv_epi64_epi8(_mm512_xor_si512(side, roundKey), _mm512_set1_epi64(0xF1E3C78F1F3E7CF8ULL), 0x63);
+	return rotateSides512<ROTATION>(substituted);
+}
+
+template <bool ENCRYPTING, unsigned int ROUNDS, unsigned int ROTATE> struct RoundsAVX512 {
+	__m512i * left;
+	__m512i * right;
+	const __m512i * key;
+	std::size_t registers;
+
+	template <unsigned int STEP>
+	__attribute__((target("avx512f,avx512bw,gfni")))
+	void round ()
+	{
+		const unsigned int roundNum = roundAt(ENCRYPTING, ROUNDS, STEP);
+		__m512i roundKey[4];	// registers is at most 4
+		for (std::size_t r = 0; r < registers; r++)
+			roundKey[r] = rotateSides512<RoundRotations<ROTATE>::key(roundNum)>(key[r]);
+
+		// Sides in the order ScalarRounds updates them
+		__m512i * firstSide = ENCRYPTING ? left : right;
+		__m512i * secondSide = ENCRYPTING ? right : left;
+		for (std::size_t r = 0; r < registers; r++)
+			firstSide[r] = _mm512_xor_si512(firstSide[r], feistel512<RoundRotations<ROTATE>::feistel(roundNum)>(secondSide[r], roundKey[r]));
+		for (std::size_t r = 0; r < registers; r++)
+			secondSide[r] = _mm512_xor_si512(secondSide[r], feistel512<RoundRotations<ROTATE>::feistel(roundNum)>(firstSide[r], roundKey[r]));
+	}
+};
+
+/* 16 lanes: 4 blocks' sides to a register. Short groups only run the registers they fill. */
+template <bool ENCRYPTING, unsigned int ROUNDS, unsigned int ROTATE>
+__attribute__((target("avx512f,avx512bw,gfni")))
+static void lanesAVX512 (CipherCore::Block * const * blocks, const CipherCore::LRSide * blockKeys, std::size_t laneCount)
+{
+	const std::size_t LANES = 16, MAX_REGISTERS = 4;
+	alignas(64) unsigned char lefts[LANES][BLOCK_BYTES/2], rights[LANES][BLOCK_BYTES/2], keys[LANES][BLOCK_BYTES/2];
+
+	// A single chain (CBC encryption) is all latency, which the 128 bit engine has less of. Every GFNI CPU has AES-NI.
+	if (laneCount == 1)
+	{
+		lanesAESNI<ENCRYPTING, ROUNDS, ROTATE>(blocks, blockKeys, laneCount);
+		return;
+	}
+
+	for (std::size_t first = 0; first < laneCount; first += LANES)
+	{
+		// Gather, padding the last register with zeros
+		std::size_t count = std::min(LANES, laneCount-first);
+		const std::size_t registers = (count+3)/4;
+		std::memset(lefts[registers*4-4], 0, sizeof(lefts[0])*4);
+		std::memset(rights[registers*4-4], 0, sizeof(rights[0])*4);
+		std::memset(keys[registers*4-4], 0, sizeof(keys[0])*4);
+		for (std::size_t lane = 0; lane < count; lane++)
+		{
+			std::memcpy(lefts[lane], &blocks[first+lane]->data[0], BLOCK_BYTES/2);
+			std::memcpy(rights[lane], &blocks[first+lane]->data[BLOCK_BYTES/2], BLOCK_BYTES/2);
+			std::memcpy(keys[lane], &blockKeys[first+lane].data[0], BLOCK_BYTES/2);
+		}
+
+		__m512i left[MAX_REGISTERS], right[MAX_REGISTERS], key[MAX_REGISTERS];
+		for (std::size_t r = 0; r < registers; r++)
+		{
+			left[r] = _mm512_load_si512(lefts[r*4]);
+			right[r] = _mm512_load_si512(rights[r*4]);
+			key[r] = _mm512_load_si512(keys[r*4]);
+		}
+
+		RoundsAVX512<ENCRYPTING, ROUNDS, ROTATE> rounds = {left, right, key, registers};
+		UnrolledRounds<0, ROUNDS>::run(rounds);
+
+		for (std::size_t r = 0; r < registers; r++)
+		{
+			_mm512_store_si512(lefts[r*4], left[r]);
+			_mm512_store_si512(rights[r*4], right[r]);
+		}
+		for (std::size_t lane = 0; lane < count; lane++)
+		{
+			std::memcpy(&blocks[first+lane]->data[0], lefts[lane], BLOCK_BYTES/2);
+			std::memcpy(&blocks[first+lane]->data[BLOCK_BYTES/2], rights[lane], BLOCK_BYTES/2);
+		}
+	}
+}
+
+static void lanesAVX512 (bool encrypting, CipherCore::Block * const * blocks, const CipherCore::LRSide * blockKeys, std::size_t laneCount)
+{
+	if (encrypting)
+		lanesAVX512<true, FEISTEL_ROUNDS, ROR_CONSTANT>(blocks, blockKeys, laneCount);
+	else
+		lanesAVX512<false, FEISTEL_ROUNDS, ROR_CONSTANT>(blocks, blockKeys, laneCount);
+}
+
+/* AES-NI is CPUID leaf 1 ECX bit 25, SSSE3 bit 9. AVX-512F and BW are leaf 7 EBX bits 16 and 30, GFNI ECX bit 8,
+ and the OS must save the ZMM state (XGETBV). The AVX-512 engine hands single lanes to AES-NI. */
+static bool cpuHasAESNI()
+{
+	unsigned int eax, ebx, ecx, edx;
+	return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 25)) && (ecx & (1u << 9));
+}
+static bool cpuHasAVX512GFNI()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 27))) // OSXSAVE
+		return false;
+	unsigned int xcr0, xcr0High;
+	__asm__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+	if ((xcr0 & 0xE6) != 0xE6 || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx & (1u << 16)) && (ebx & (1u << 30)) && (ecx & (1u << 8)) && cpuHasAESNI();
+}
+#endif
+
+static bool alwaysSupported() { return true; }
+
+struct CipherCore::LaneEngine {
+	const char *	name;
+	unsigned int	lanes;
+	LaneFunction	run;
+	bool			(*supported)();
+};
+
+/* Widest first */
+const CipherCore::LaneEngine CipherCore::laneEngines[] = {
+#ifdef CIPHERCORE_HAVE_VECTOR_LANES
+	{"avx512", 16, lanesAVX512, cpuHasAVX512GFNI},
+	{"aes-ni", 8, lanesAESNI, cpuHasAESNI},
+#endif
+	{"scalar", 8, lanesScalar, alwaysSupported}
+};
+
+// Public Methods
+
+// Builds the per key tables for round key generation
+void CipherCore::expandKey (const Block & baseKey, KeySchedule & schedule)
+{
+	// Split the base key
+	LRSide keyHalf1 = *(const LRSide*)&baseKey.data[0];
+	LRSide keyHalf2 = *(((const LRSide*)&baseKey.data[0])+1);
+
+	// Round key = ror (ror (keyHalf1, cluster+ROR_CONSTANT+3) ^ ror (keyHalf2, block+ROR_CONSTANT+7), round*4+ROR_CONSTANT+13)
+	// The first two rotations only see the cluster and block numbers modulo BLOCK_BITS/2, so they are tabled by residue.
+	for (unsigned long residue = 0; residue < BLOCK_BITS/2; residue++)
+	{
+		schedule.clusterKeys[residue]	= rorLRSide(keyHalf1, (residue+ROR_CONSTANT+3)%(BLOCK_BITS/2));
+		schedule.blockKeys[residue]		= rorLRSide(keyHalf2, (residue+ROR_CONSTANT+7)%(BLOCK_BITS/2));
+	}
+}
+
+// Encrypts the first len bytes of cluster clusterIndex of a file with clusterBytes clusters
+void CipherCore::encryptCluster (const KeySchedule & schedule, unsigned long clusterIndex, const void * in, void * out,
+								 std::size_t len, std::size_t clusterBytes, Block & chain)
+{
+	encryptBlocks(schedule, clusterIndex, clusterIndex*(clusterBytes/BLOCK_BYTES-1),
+				  (const Block *)in, (Block *)out, len/BLOCK_BYTES, chain);
+}
+
+// Decrypts the first len bytes of cluster clusterIndex of a file with clusterBytes clusters
+void CipherCore::decryptCluster (const KeySchedule & schedule, unsigned long clusterIndex, const void * in, void * out,
+								 std::size_t len, std::size_t clusterBytes, Block & chain)
+{
+	decryptBlocks(schedule, clusterIndex, clusterIndex*(clusterBytes/BLOCK_BYTES-1),
+				  (const Block *)in, (Block *)out, len/BLOCK_BYTES, chain);
+}
+
+// CBC encrypts blockCount blocks. Each block needs the one before it encrypted, so this runs front to back,
+//	one lane at a time on the lane engine, whose S-box instructions are still quicker than the byte tables.
+void CipherCore::encryptBlocks (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+								const Block * in, Block * out, std::size_t blockCount, Block & chain)
+{
+	for (std::size_t i = 0; i < blockCount; i++)
+	{
+		LRSide key = blockKey(schedule, clusterNum, blockNum+i);
+		Block * block = &out[i];
+		out[i] = in[i] ^ chain;
+		blockEncLanes(&block, &key, 1);
+		chain = out[i];
+	}
+}
+
+// CBC decrypts blockCount blocks. Every block only needs its own ciphertext and the one before, so they go through
+//	blockDecLanes lanes() at a time. Runs back to front, so block i-1 is still ciphertext when block i needs it, even in place.
+void CipherCore::decryptBlocks (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+								const Block * in, Block * out, std::size_t blockCount, Block & chain)
+{
+	if (blockCount == 0)
+		return;
+
+	Block decrypted[FEISTEL_MAX_LANES];
+	Block * blocks[FEISTEL_MAX_LANES];
+	LRSide blockKeys[FEISTEL_MAX_LANES];
+	const std::size_t groupLanes = lanes();
+	Block lastCipher = in[blockCount-1];
+
+	for (std::size_t end = blockCount; end > 0; )
+	{
+		std::size_t first = (end > groupLanes) ? end-groupLanes : 0;
+		for (std::size_t i = first; i < end; i++)
+		{
+			decrypted[i-first] = in[i];
+			blocks[i-first] = &decrypted[i-first];
+			blockKeys[i-first] = blockKey(schedule, clusterNum, blockNum+i);
+		}
+		blockDecLanes(blocks, blockKeys, end-first);
+
+		for (std::size_t i = end; i-- > first; )
+			out[i] = decrypted[i-first] ^ (i ? in[i-1] : chain);
+		end = first;
+	}
+
+	chain = lastCipher;
+}
+
+// First tweak of cluster clusterNum in XEX mode: the IV with the cluster number added into its first 8 bytes,
+//	encrypted with the keys of block 0, then doubled so no block's tweak is that encryption itself
+CipherCore::Block CipherCore::clusterTweak (const KeySchedule & schedule, unsigned long clusterNum, const Block & iv)
+{
+	Block tweak = iv;
+	uint64_t first;
+	std::memcpy(&first, &tweak.data[0], sizeof(first));
+	first ^= (uint64_t)clusterNum;
+	std::memcpy(&tweak.data[0], &first, sizeof(first));
+
+	LRSide keys[FEISTEL_ROUNDS];
+	roundKeys(schedule, clusterNum, 0, keys);
+	blockEnc(tweak, keys);
+	doubleTweak(tweak);
+	return tweak;
+}
+
+// XEX encrypts the first len bytes of cluster clusterIndex of a file with clusterBytes clusters
+void CipherCore::encryptClusterXEX (const KeySchedule & schedule, unsigned long clusterIndex, const Block & iv, const void * in, void * out,
+									std::size_t len, std::size_t clusterBytes)
+{
+	Block tweak = clusterTweak(schedule, clusterIndex, iv);
+	encryptBlocksXEX(schedule, clusterIndex, clusterIndex*(clusterBytes/BLOCK_BYTES-1),
+					 (const Block *)in, (Block *)out, len/BLOCK_BYTES, tweak);
+}
+
+// XEX decrypts the first len bytes of cluster clusterIndex of a file with clusterBytes clusters
+void CipherCore::decryptClusterXEX (const KeySchedule & schedule, unsigned long clusterIndex, const Block & iv, const void * in, void * out,
+									std::size_t len, std::size_t clusterBytes)
+{
+	Block tweak = clusterTweak(schedule, clusterIndex, iv);
+	decryptBlocksXEX(schedule, clusterIndex, clusterIndex*(clusterBytes/BLOCK_BYTES-1),
+					 (const Block *)in, (Block *)out, len/BLOCK_BYTES, tweak);
+}
+
+// XEX encrypts blockCount blocks, the first with tweak, which is left at the tweak of the block after the last
+void CipherCore::encryptBlocksXEX (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+								   const Block * in, Block * out, std::size_t blockCount, Block & tweak)
+{
+	xexBlocks(true, schedule, clusterNum, blockNum, in, out, blockCount, tweak);
+}
+
+// XEX decrypts blockCount blocks, see encryptBlocksXEX
+void CipherCore::decryptBlocksXEX (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+								   const Block * in, Block * out, std::size_t blockCount, Block & tweak)
+{
+	xexBlocks(false, schedule, clusterNum, blockNum, in, out, blockCount, tweak);
+}
+
+// Key of block blockNum in cluster clusterNum, which each of its round keys is a rotation of
+CipherCore::LRSide CipherCore::blockKey (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum)
+{
+	return schedule.clusterKeys[clusterNum%(BLOCK_BITS/2)] ^ schedule.blockKeys[blockNum%(BLOCK_BITS/2)];
+}
+
+// The FEISTEL_ROUNDS round keys of block blockNum in cluster clusterNum
+void CipherCore::roundKeys (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum, LRSide * keys)
+{
+	expandBlockKey(blockKey(schedule, clusterNum, blockNum), keys);
+}
+
+// Encrypts one block with the round keys for its block number
+void CipherCore::blockEnc (Block & block, const LRSide * roundKeys)
+{
+	Block * blocks = &block;
+	ScalarRounds<true, FEISTEL_ROUNDS, ROR_CONSTANT> rounds = {&blocks, (const LRSide (*)[FEISTEL_ROUNDS])roundKeys, 1};
+	UnrolledRounds<0, FEISTEL_ROUNDS>::run(rounds);
+}
+
+
+// Decrypts one block with the round keys for its block number
+void CipherCore::blockDec (Block & block, const LRSide * roundKeys)
+{
+	Block * blocks = &block;
+	ScalarRounds<false, FEISTEL_ROUNDS, ROR_CONSTANT> rounds = {&blocks, (const LRSide (*)[FEISTEL_ROUNDS])roundKeys, 1};
+	UnrolledRounds<0, FEISTEL_ROUNDS>::run(rounds);
+}
+
+// Encrypts blocks[lane] with blockKeys[lane] for every lane, on the lane engine
+void CipherCore::blockEncLanes (Block * const * blocks, const LRSide * blockKeys, std::size_t laneCount)
+{
+	currentLaneEngine()->run(true, blocks, blockKeys, laneCount);
+}
+
+// Decrypts blocks[lane] with blockKeys[lane] for every lane, on the lane engine
+void CipherCore::blockDecLanes (Block * const * blocks, const LRSide * blockKeys, std::size_t laneCount)
+{
+	currentLaneEngine()->run(false, blocks, blockKeys, laneCount);
+}
+
+// Blocks the lane engine takes at once
+unsigned int CipherCore::lanes ()
+{
+	return currentLaneEngine()->lanes;
+}
+
+const char * CipherCore::engineName ()
+{
+	return currentLaneEngine()->name;
+}
+
+// Switches lane engines by name, for testing and benchmarks. Fails if the CPU cannot run it.
+bool CipherCore::setEngine (const std::string & name)
+{
+	for (std::size_t i = 0; i < sizeof(laneEngines)/sizeof(laneEngines[0]); i++)
+		if (name == laneEngines[i].name && laneEngines[i].supported())
+		{
+			currentLaneEngine() = &laneEngines[i];
+			return true;
+		}
+	return false;
+}
+
+// Private Methods
+
+// The lane engine in use. Starts as the widest supported one, unless WILHELMCBC_FEISTEL names another.
+const CipherCore::LaneEngine *& CipherCore::currentLaneEngine ()
+{
+	// Picked once, by the first call from any thread (static initialization is thread safe)
+	static const LaneEngine * engine = defaultLaneEngine();
+	return engine;
+}
+
+// Picks the engine currentLaneEngine starts with
+const CipherCore::LaneEngine * CipherCore::defaultLaneEngine ()
+{
+	const LaneEngine * engine = 0;
+	const std::size_t count = sizeof(laneEngines)/sizeof(laneEngines[0]);
+	for (std::size_t i = 0; i < count && !engine; i++)
+		if (laneEngines[i].supported())
+			engine = &laneEngines[i];
+
+	const char * requested = std::getenv("WILHELMCBC_FEISTEL");
+	for (std::size_t i = 0; requested && i < count; i++)
+		if (std::strcmp(requested, laneEngines[i].name) == 0 && laneEngines[i].supported())
+			engine = &laneEngines[i];
+	return engine;
+}
+
+// Portable lane engine: the byte table feistel(), see ScalarRounds
+void CipherCore::lanesScalar (bool encrypting, Block * const * blocks, const LRSide * blockKeys, std::size_t laneCount)
+{
+	LRSide laneKeys[FEISTEL_MAX_LANES][FEISTEL_ROUNDS];
+
+	for (std::size_t first = 0; first < laneCount; first += FEISTEL_MAX_LANES)
+	{
+		std::size_t count = std::min<std::size_t>(FEISTEL_MAX_LANES, laneCount-first);
+		for (std::size_t lane = 0; lane < count; lane++)
+			expandBlockKey(blockKeys[first+lane], laneKeys[lane]);
+
+		if (encrypting)
+		{
+			ScalarRounds<true, FEISTEL_ROUNDS, ROR_CONSTANT> rounds = {&blocks[first], laneKeys, count};
+			UnrolledRounds<0, FEISTEL_ROUNDS>::run(rounds);
+		}
+		else
+		{
+			ScalarRounds<false, FEISTEL_ROUNDS, ROR_CONSTANT> rounds = {&blocks[first], laneKeys, count};
+			UnrolledRounds<0, FEISTEL_ROUNDS>::run(rounds);
+		}
+	}
+}
+
+// Round keys from a block key, see roundKeys
+void CipherCore::expandBlockKey (const LRSide & key, LRSide * keys)
+{
+	KeyRounds<ROR_CONSTANT> rounds = {key, keys};
+	UnrolledRounds<0, FEISTEL_ROUNDS>::run(rounds);
+}
+
+// XEX encrypts or decrypts blockCount blocks, lanes() at a time. Each block is read before it is written, so in may be out.
+void CipherCore::xexBlocks (bool encrypting, const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+							const Block * in, Block * out, std::size_t blockCount, Block & tweak)
+{
+	Block tweaks[FEISTEL_MAX_LANES];
+	Block * blocks[FEISTEL_MAX_LANES];
+	LRSide blockKeys[FEISTEL_MAX_LANES];
+	const std::size_t groupLanes = lanes();
+
+	for (std::size_t first = 0; first < blockCount; first += groupLanes)
+	{
+		std::size_t laneCount = std::min(groupLanes, blockCount-first);
+		for (std::size_t lane = 0; lane < laneCount; lane++)
+		{
+			tweaks[lane] = tweak;
+			doubleTweak(tweak);
+
+			out[first+lane] = in[first+lane] ^ tweaks[lane];
+			blocks[lane] = &out[first+lane];
+			blockKeys[lane] = blockKey(schedule, clusterNum, blockNum+first+lane);
+		}
+
+		if (encrypting)
+			blockEncLanes(blocks, blockKeys, laneCount);
+		else
+			blockDecLanes(blocks, blockKeys, laneCount);
+
+		for (std::size_t lane = 0; lane < laneCount; lane++)
+			out[first+lane] = out[first+lane] ^ tweaks[lane];
+	}
+}
+
+// Multiplies the tweak by x in GF(2^256), modulo x^256 + x^10 + x^5 + x^2 + 1, as 4 little endian 64 bit words
+void CipherCore::doubleTweak (Block & tweak)
+{
+	uint64_t words[4];
+	std::memcpy(words, &tweak.data[0], sizeof(words));
+	uint64_t carry = words[3] >> 63;
+
+	for (unsigned int i = 3; i > 0; i--)
+		words[i] = (words[i] << 1) | (words[i-1] >> 63);
+	words[0] = (words[0] << 1) ^ (carry * 0x425);
+	std::memcpy(&tweak.data[0], words, sizeof(words));
+}
+
+// Right Circulular bit shifts an LRSide
+CipherCore::LRSide CipherCore::rorLRSide (const CipherCore::LRSide & input, unsigned long rotateCount)
+{
+	uint64_t inputWords[2], resultWords[2];
+	std::memcpy(inputWords, &input.data[0], sizeof(inputWords));
+
+	// Shift counts are taken modulo 64, as the x86 shift instructions the original cipher was built with do.
+	// Counts of 0 and 64 (which occur in round key generation) therefore OR the two halves together, rather than being undefined.
+	for (unsigned int i = 0; i < 2; i++)
+		resultWords[i] = (inputWords[i]>>(rotateCount&63)) | (inputWords[(i+1)%2]<<((64-rotateCount)&63));
+
+	LRSide result;
+	std::memcpy(&result.data[0], resultWords, sizeof(resultWords));
+	return result;
+}
+
+/**** Overloaded Operators ****/
+
+// Block addition operator
+CipherCore::Block & CipherCore::Block::operator+= (const CipherCore::Block &rhs)
+{
+	// Addition, done in 64bit blocks - no carry between 64bit blocks.
+	// Not true addition, but sufficient for key permutation
+	// Words are copied in and out, blocks may sit at any alignment in caller memory
+	uint64_t dataWords[BLOCK_BYTES/8], rhsWords[BLOCK_BYTES/8];
+	std::memcpy(dataWords, &data[0], BLOCK_BYTES);
+	std::memcpy(rhsWords, &rhs.data[0], BLOCK_BYTES);
+	
+	for (unsigned int i = 0; i < BLOCK_BYTES/8; i++)
+	{
+			dataWords[i] += rhsWords[i];
+	}
+
+	std::memcpy(&data[0], dataWords, BLOCK_BYTES);
+	return *this;
+}
+
+// Block equality operator
+bool CipherCore::Block::operator== (const CipherCore::Block &rhs) const
+{
+	return std::memcmp(&data[0], &rhs.data[0], BLOCK_BYTES) == 0;
+}
+
+// Block xor operator
+CipherCore::Block CipherCore::Block::operator^ (const CipherCore::Block & rhs) const
+{
+	// Words are copied in and out, blocks may sit at any alignment in caller memory
+	uint64_t words[BLOCK_BYTES/8], rhsWords[BLOCK_BYTES/8];
+	std::memcpy(words, &data[0], BLOCK_BYTES);
+	std::memcpy(rhsWords, &rhs.data[0], BLOCK_BYTES);
+	for (unsigned int i = 0; i < BLOCK_BYTES/8; i++)
+		words[i] ^= rhsWords[i];
+
+	Block result;
+	std::memcpy(&result.data[0], words, BLOCK_BYTES);
+	return result;
+}
+
+// LRSide xor operator
+CipherCore::LRSide CipherCore::LRSide::operator^ (const CipherCore::LRSide & rhs) const
+{
+	// As Block's, sides of caller blocks may sit at any alignment
+	uint64_t words[BLOCK_BYTES/16], rhsWords[BLOCK_BYTES/16];
+	std::memcpy(words, &data[0], BLOCK_BYTES/2);
+	std::memcpy(rhsWords, &rhs.data[0], BLOCK_BYTES/2);
+	for (unsigned int i = 0; i < BLOCK_BYTES/16; i++)
+		words[i] ^= rhsWords[i];
+
+	LRSide result;
+	std::memcpy(&result.data[0], words, BLOCK_BYTES/2);
+	return result;
+}
@@ -0,0 +1,141 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for CipherCore class
+
+	The WilhelmCBC block cipher and its CBC chaining, with no file state. Every function is static, works on
+	caller memory, allocates nothing and only reads the KeySchedule, so any number of threads may share one
+	schedule. WilhelmCBC is the file driver on top: header, IV, padding block, hashes and IO.
+
+	Round keys depend on the cluster number and the block number within the file. Every full cluster moves
+	the block number on by one less than its block count, so cluster clusterIndex starts at block
+	clusterIndex * (clusterBytes/BLOCK_BYTES - 1), which the Cluster functions work out.
+
+	chain is the ciphertext block before the first one passed in (the IV for cluster 0), and is set to the last
+	ciphertext block on return, ready for the next cluster. in and out may be the same buffer.
+
+	The XEX functions are a second mode of operation for the same block cipher, where no block depends on another:
+	C = blockEnc(P ^ T) ^ T. Each cluster's first tweak T is clusterTweak, the IV with the cluster number mixed in,
+	encrypted and doubled, and each further block doubles it again (in GF(2^256)), which tweak carries between calls
+	like chain. Blocks go through blockEncLanes or blockDecLanes lanes() at a time.
+
+	blockEncLanes and blockDecLanes run many independent blocks through the rounds together, for XEX, CBC decryption
+	and encryptBatch. They use the widest lane engine the CPU supports: AVX-512 with GFNI (16 blocks, 4 to a register),
+	AES-NI (8 blocks, one side per register), or the portable byte table version. The vector engines get the S-box
+	from the AES instructions, which use the same Rijndael table, and derive the round keys from one block key per lane
+	in registers. WILHELMCBC_FEISTEL names another engine, for testing and benchmarks.
+
+	Every engine, and blockEnc and blockDec, runs rounds templated on the round count and ROR_CONSTANT, unrolled at
+	compile time, so each round's rotations are constant shifts.
+
+	Usage:
+	********************************
+	CipherCore::KeySchedule schedule;
+	CipherCore::expandKey (baseKey, schedule);
+	CipherCore::encryptCluster (schedule, clusterIndex, in, out, len, clusterBytes, chain);
+	CipherCore::decryptCluster (schedule, clusterIndex, in, out, len, clusterBytes, chain);
+	CipherCore::encryptClusterXEX (schedule, clusterIndex, iv, in, out, len, clusterBytes);
+	********************************
+*/
+
+#ifndef __WilhelmCBC__CipherCore__
+#define __WilhelmCBC__CipherCore__
+
+#include <cstddef>		// std::size_t
+#include <stdint.h>		// uint64_t
+#include <string>		// std::string
+
+// GLOBAL CONST
+
+const unsigned int BLOCK_BYTES		= 32;
+const unsigned int BLOCK_BITS		= 256;
+const unsigned int ROR_CONSTANT		= 27;
+const unsigned int FEISTEL_ROUNDS	= 16;
+const unsigned int FEISTEL_MAX_LANES	= 16;	// Most blocks any lane engine takes at once
+
+class CipherCore {
+public:
+// Types
+	// Block, used for referencing 1 Block of data.
+	struct Block {
+		unsigned char data[BLOCK_BYTES];
+		Block & operator+= (const Block &rhs);
+		bool    operator== (const Block &rhs) const;
+		Block   operator^  (const Block &rhs) const;
+	};
+
+	// LRSide, used for referencing 1 side in a feistel process.
+	struct LRSide {
+		unsigned char data[BLOCK_BYTES/2];
+		LRSide operator^ (const LRSide & rhs) const;
+	};
+
+	// KeySchedule, per key tables of the two rotated key halves that make up every round key.
+	// Round keys only depend on the cluster and block numbers modulo BLOCK_BITS/2, so each table has one entry per residue.
+	struct KeySchedule {
+		LRSide clusterKeys[BLOCK_BITS/2];	// First key half, indexed by cluster number % (BLOCK_BITS/2)
+		LRSide blockKeys[BLOCK_BITS/2];		// Second key half, indexed by block number % (BLOCK_BITS/2)
+	};
+
+// Public Methods
+	static void expandKey (const Block & baseKey, KeySchedule & schedule);
+
+	// len bytes of cluster clusterIndex, a multiple of BLOCK_BYTES and at most clusterBytes
+	static void encryptCluster (const KeySchedule & schedule, unsigned long clusterIndex, const void * in, void * out,
+								std::size_t len, std::size_t clusterBytes, Block & chain);
+	static void decryptCluster (const KeySchedule & schedule, unsigned long clusterIndex, const void * in, void * out,
+								std::size_t len, std::size_t clusterBytes, Block & chain);
+
+	// blockCount blocks starting at block blockNum of cluster clusterNum
+	static void encryptBlocks (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+							   const Block * in, Block * out, std::size_t blockCount, Block & chain);
+	static void decryptBlocks (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+							   const Block * in, Block * out, std::size_t blockCount, Block & chain);
+
+	// XEX mode, see header
+	static Block clusterTweak (const KeySchedule & schedule, unsigned long clusterNum, const Block & iv);
+	static void encryptClusterXEX (const KeySchedule & schedule, unsigned long clusterIndex, const Block & iv, const void * in, void * out,
+								   std::size_t len, std::size_t clusterBytes);
+	static void decryptClusterXEX (const KeySchedule & schedule, unsigned long clusterIndex, const Block & iv, const void * in, void * out,
+								   std::size_t len, std::size_t clusterBytes);
+	static void encryptBlocksXEX (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+								  const Block * in, Block * out, std::size_t blockCount, Block & tweak);
+	static void decryptBlocksXEX (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum,
+								  const Block * in, Block * out, std::size_t blockCount, Block & tweak);
+
+	// Single blocks, no chaining
+	static LRSide blockKey (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum);
+	static void roundKeys (const KeySchedule & schedule, unsigned long clusterNum, unsigned long blockNum, LRSide * keys);
+	static void blockEnc (Block & block, const LRSide * roundKeys);
+	static void blockDec (Block & block, const LRSide * roundKeys);
+
+	// Independent blocks, each with its blockKey, see header. Any laneCount, best in multiples of lanes().
+	static void blockEncLanes (Block * const * blocks, const LRSide * blockKeys, std::size_t laneCount);
+	static void blockDecLanes (Block * const * blocks, const LRSide * blockKeys, std::size_t laneCount);
+
+	// Lane engine in use. setEngine is for tests and benchmarks, and not safe while other threads encrypt.
+	typedef void (*LaneFunction)(bool encrypting, Block * const * blocks, const LRSide * blockKeys, std::size_t laneCount);
+	static unsigned int lanes ();
+	static const char * engineName ();
+	static bool setEngine (const std::string & name);
+
+private:
+// Private Types
+	struct LaneEngine;
+	static const LaneEngine laneEngines[];
+
+// Private Methods
+	static const LaneEngine *& currentLaneEngine ();
+	static const LaneEngine * defaultLaneEngine ();
+	static void lanesScalar (bool, Block * const *, const LRSide *, std::size_t);
+	static LRSide rorLRSide (const LRSide &, unsigned long);
+	static void expandBlockKey (const LRSide &, LRSide *);
+	static void xexBlocks (bool, const KeySchedule &, unsigned long, unsigned long, const Block *, Block *, std::size_t, Block &);
+	static void doubleTweak (Block &);
+};
+
+#endif /* defined(__WilhelmCBC__CipherCore__) */
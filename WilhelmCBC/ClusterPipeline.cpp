@@ -0,0 +1,178 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for ClusterPipeline class
+ */
+
+#include "ClusterPipeline.h"
+
+#include <thread>		// std::thread
+
+// Public Methods
+
+// Runs read, process and write over every cluster until the reader reports the last one, then returns
+void ClusterPipeline::run (const ReadStage & read, const Stage & process, const Stage & write)
+{
+	// Every slot starts out free
+	for (std::size_t slot = 0; slot < _slots; slot++)
+	{
+		_lastSlot[slot] = false;
+		_free.push(slot);
+	}
+
+	std::thread reader ([&] ()
+	{
+		try
+		{
+			std::size_t slot;
+			while (_free.pop(slot))
+			{
+				bool last = read(slot);
+				_lastSlot[slot] = last;
+				_read.push(slot);
+				if (last)
+					break;
+			}
+		}
+		catch (...)
+		{
+			fail();
+		}
+	});
+
+	std::thread writer ([&] ()
+	{
+		try
+		{
+			std::size_t slot;
+			while (_processed.pop(slot))
+			{
+				write(slot);
+				if (_lastSlot[slot])
+					break;
+				_free.push(slot);
+			}
+		}
+		catch (...)
+		{
+			fail();
+		}
+	});
+
+	// Calling thread does the crypto
+	try
+	{
+		std::size_t slot;
+		while (_read.pop(slot))
+		{
+			// Checked before handing the slot on, the reader refills it once the writer is done with it
+			bool last = _lastSlot[slot];
+			process(slot);
+			_processed.push(slot);
+			if (last)
+				break;
+		}
+	}
+	catch (...)
+	{
+		fail();
+	}
+
+	reader.join();
+	writer.join();
+
+	// Ready for another run
+	std::exception_ptr error = _error;
+	_error = std::exception_ptr();
+	_free.reset();
+	_read.reset();
+	_processed.reset();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+std::size_t ClusterPipeline::slots () const
+{
+	return _slots;
+}
+
+// Private Methods
+
+// Keeps the first exception and unblocks every stage
+void ClusterPipeline::fail ()
+{
+	{
+		std::lock_guard<std::mutex> lock (_errorMutex);
+		if (!_error)
+			_error = std::current_exception();
+	}
+	closeRings();
+}
+
+void ClusterPipeline::closeRings ()
+{
+	_free.close();
+	_read.close();
+	_processed.close();
+}
+
+// SlotRing
+
+void ClusterPipeline::SlotRing::push (std::size_t slot)
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+	_changed.wait(lock, [this] { return _count < _ring.size() || _closed; });
+	if (_closed)
+		return;
+
+	_ring[(_head + _count) % _ring.size()] = slot;
+	_count++;
+	_changed.notify_all();
+}
+
+bool ClusterPipeline::SlotRing::pop (std::size_t & slot)
+{
+	std::unique_lock<std::mutex> lock (_mutex);
+	_changed.wait(lock, [this] { return _count > 0 || _closed; });
+	if (_closed)
+		return false;
+
+	slot = _ring[_head];
+	_head = (_head + 1) % _ring.size();
+	_count--;
+	_changed.notify_all();
+	return true;
+}
+
+void ClusterPipeline::SlotRing::close ()
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	_closed = true;
+	_changed.notify_all();
+}
+
+// Empties and reopens the ring
+void ClusterPipeline::SlotRing::reset ()
+{
+	std::lock_guard<std::mutex> lock (_mutex);
+	_head = 0;
+	_count = 0;
+	_closed = false;
+}
+
+ClusterPipeline::SlotRing::SlotRing (std::size_t capacity)
+	: _ring (capacity), _head (0), _count (0), _closed (false)
+{
+}
+
+// Constructors
+
+ClusterPipeline::ClusterPipeline (std::size_t slots)
+	: _slots (slots ? slots : 1), _free (_slots), _read (_slots), _processed (_slots), _lastSlot (_slots)
+{
+}
@@ -0,0 +1,80 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for ClusterPipeline class
+
+	Overlaps reading, encrypting/decrypting and writing of consecutive clusters for stream input and output.
+	The caller owns a fixed set of cluster sized buffers (slots), and the pipeline passes slot indices
+	reader -> process -> writer -> reader through bounded rings, so at most slots() clusters are in flight.
+	The reader and writer each get a thread, process runs on the calling thread.
+	Slots reach every stage in the order they were read.
+
+	Usage:
+	********************************
+	ClusterPipeline pipeline (slots);
+	pipeline.run (read, process, write);	// read (slot) returns true once it has read the last cluster
+	********************************
+
+	An exception in any stage stops the others, and run() rethrows it.
+*/
+
+#ifndef __WilhelmCBC__ClusterPipeline__
+#define __WilhelmCBC__ClusterPipeline__
+
+#include <vector>				// std::vector
+#include <mutex>				// std::mutex
+#include <condition_variable>	// std::condition_variable
+#include <exception>			// std::exception_ptr
+#include <functional>			// std::function
+
+class ClusterPipeline {
+public:
+// Types
+	typedef std::function<bool (std::size_t slot)> ReadStage;	// Fills slot, returns true for the last one
+	typedef std::function<void (std::size_t slot)> Stage;
+
+// Public Methods
+	void run (const ReadStage & read, const Stage & process, const Stage & write);
+	std::size_t slots () const;
+
+// Constructors
+	explicit ClusterPipeline (std::size_t slots);
+
+private:
+	// Bounded FIFO of slot indices. pop() waits for an entry, and returns false once the ring is closed.
+	class SlotRing {
+	public:
+		void push (std::size_t slot);
+		bool pop (std::size_t & slot);
+		void close ();
+		void reset ();
+		explicit SlotRing (std::size_t capacity);
+
+	private:
+		std::vector<std::size_t>	_ring;
+		std::size_t					_head;
+		std::size_t					_count;
+		bool						_closed;
+		std::mutex					_mutex;
+		std::condition_variable		_changed;
+	};
+
+// Private Methods
+	void fail ();
+	void closeRings ();
+
+// Private Data Members
+	std::size_t			_slots;
+	SlotRing			_free;		// Ready for the reader
+	SlotRing			_read;		// Ready for process
+	SlotRing			_processed;	// Ready for the writer
+	std::vector<char>	_lastSlot;	// Set by the reader on the slot holding the last cluster
+	std::mutex			_errorMutex;
+	std::exception_ptr	_error;
+};
+
+#endif /* defined(__WilhelmCBC__ClusterPipeline__) */
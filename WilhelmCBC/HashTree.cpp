@@ -0,0 +1,97 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for HashTree class
+ */
+
+#include "HashTree.h"
+
+// Public Methods
+
+// Adds the digest of the next cluster
+void HashTree::add (const SHA256::digest & leaf)
+{
+	if (_mode == FLAT)
+	{
+		_flatHash.add(&leaf.data[0], SHA256::digest::size);
+		_leafCount++;
+		return;
+	}
+
+	// Binary counter: every set bit that carries merges two equal sized subtrees
+	SHA256::digest node = leaf;
+	unsigned int level = 0;
+	for (; _leafCount & ((uint64_t)1 << level); level++)
+		node = combine(_levels[level], node);
+
+	_levels[level] = node;
+	_leafCount++;
+}
+
+// Returns the root over all digests added so far
+SHA256::digest HashTree::finish ()
+{
+	SHA256::digest root;
+
+	if (_mode == FLAT)
+		root = _flatHash.finish();
+	else if (_leafCount == 0)
+		root = SHA256().finish();
+	else
+	{
+		// Fold the partial subtrees together, smallest (rightmost) first
+		bool haveRoot = false;
+		for (unsigned int level = 0; level < 64; level++)
+		{
+			if (!(_leafCount & ((uint64_t)1 << level)))
+				continue;
+
+			root = haveRoot ? combine(_levels[level], root) : _levels[level];
+			haveRoot = true;
+		}
+	}
+
+	reset(_mode);
+	return root;
+}
+
+void HashTree::reset (Mode mode)
+{
+	_mode = mode;
+	_leafCount = 0;
+	_flatHash.init();
+}
+
+HashTree::Mode HashTree::mode () const
+{
+	return _mode;
+}
+
+uint64_t HashTree::leafCount () const
+{
+	return _leafCount;
+}
+
+// Interior node of the Merkle tree
+SHA256::digest HashTree::combine (const SHA256::digest & left, const SHA256::digest & right)
+{
+	// Prefix keeps interior nodes from being mistaken for cluster digests
+	const SHA256::Byte nodePrefix = 0x01;
+
+	SHA256 hash;
+	hash.add(&nodePrefix, 1);
+	hash.add(&left.data[0], SHA256::digest::size);
+	hash.add(&right.data[0], SHA256::digest::size);
+	return hash.finish();
+}
+
+// Constructors
+
+HashTree::HashTree (Mode mode)
+{
+	reset(mode);
+}
@@ -0,0 +1,51 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for HashTree class
+
+	Folds the per cluster SHA256 digests of a file into the single integrity hash stored at its end,
+	as they are produced, without keeping the list of digests around.
+
+	FLAT	SHA256 (digest 0 || digest 1 || ... ), the original hash of hashes. Streamed through one SHA256.
+	MERKLE	Binary Merkle tree over the digests, node = SHA256 (0x01 || left || right).
+			An unpaired node at the end of a level is carried up unchanged. Holds one digest per tree level.
+*/
+
+#ifndef __WilhelmCBC__HashTree__
+#define __WilhelmCBC__HashTree__
+
+#include <stdint.h>		// uint64_t
+
+#include "SHA256.h"		// Public Domain SHA256 hash function
+
+class HashTree {
+public:
+// Types
+	enum Mode {FLAT = 0, MERKLE = 1};
+
+// Public Methods
+	void			add (const SHA256::digest & leaf);
+	SHA256::digest	finish ();	// Resets for the next file
+	void			reset (Mode mode);
+
+	Mode		mode () const;
+	uint64_t	leafCount () const;
+
+	static SHA256::digest combine (const SHA256::digest & left, const SHA256::digest & right);
+
+// Constructors
+	explicit HashTree (Mode mode = MERKLE);
+
+private:
+// Private Data Members
+	Mode			_mode;
+	uint64_t		_leafCount;
+	SHA256			_flatHash;
+	SHA256::digest	_levels[64];	// _levels[i] holds a complete subtree of 2^i leaves when bit i of _leafCount is set
+};
+
+#endif /* defined(__WilhelmCBC__HashTree__) */
@@ -0,0 +1,158 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for MappedFile class
+ */
+
+#include "MappedFile.h"
+
+#if !defined(_WIN32)
+#  include <sys/mman.h>	// mmap
+#  include <sys/stat.h>	// fstat
+#  include <fcntl.h>	// open
+#  include <unistd.h>	// ftruncate, close
+#endif
+
+// Public Methods
+
+// Maps an existing regular file read only
+bool MappedFile::openRead (const std::string & filename)
+{
+	close();
+
+#if defined(_WIN32)
+	(void)filename;
+	return false;
+#else
+	_fd = ::open(filename.c_str(), O_RDONLY);
+	if (_fd < 0)
+		return false;
+
+	// Only regular, non empty files can be mapped
+	struct stat info;
+	if (fstat(_fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0)
+	{
+		close();
+		return false;
+	}
+
+	void * mapping = mmap(NULL, (std::size_t)info.st_size, PROT_READ, MAP_SHARED, _fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+
+	_data = (unsigned char *)mapping;
+	_size = (std::size_t)info.st_size;
+
+	// Clusters are read front to back
+	madvise(mapping, _size, MADV_SEQUENTIAL);
+	return true;
+#endif
+}
+
+// Creates or truncates filename, sizes it to size bytes and maps it writable
+bool MappedFile::openWrite (const std::string & filename, std::size_t size)
+{
+	close();
+
+#if defined(_WIN32)
+	(void)filename;
+	(void)size;
+	return false;
+#else
+	if (size == 0)
+		return false;
+
+	_fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if (_fd < 0)
+		return false;
+
+	// Pipes and devices cannot be sized or mapped
+	struct stat info;
+	if (fstat(_fd, &info) != 0 || !S_ISREG(info.st_mode) || ftruncate(_fd, (off_t)size) != 0)
+	{
+		close();
+		return false;
+	}
+
+	void * mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+	if (mapping == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+
+	_data = (unsigned char *)mapping;
+	_size = size;
+	return true;
+#endif
+}
+
+void MappedFile::close ()
+{
+#if !defined(_WIN32)
+	if (_data)
+		munmap(_data, _size);
+	if (_fd >= 0)
+		::close(_fd);
+#endif
+
+	_fd = -1;
+	_data = NULL;
+	_size = 0;
+}
+
+// Unmaps, then trims an output file to the number of bytes actually written. Returns false if the file could not be trimmed.
+bool MappedFile::close (std::size_t finalSize)
+{
+	bool trimmed = true;
+
+#if !defined(_WIN32)
+	if (_data)
+		munmap(_data, _size);
+	_data = NULL;
+
+	if (_fd >= 0)
+		trimmed = (ftruncate(_fd, (off_t)finalSize) == 0);
+#else
+	(void)finalSize;
+#endif
+
+	close();
+	return trimmed;
+}
+
+bool MappedFile::isOpen () const
+{
+	return _data != NULL;
+}
+
+unsigned char * MappedFile::data () const
+{
+	return _data;
+}
+
+std::size_t MappedFile::size () const
+{
+	return _size;
+}
+
+// Constructors
+
+MappedFile::MappedFile ()
+{
+	_fd = -1;
+	_data = NULL;
+	_size = 0;
+}
+
+MappedFile::~MappedFile ()
+{
+	close();
+}
@@ -0,0 +1,47 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for MappedFile class
+
+	Memory maps a regular file, read only for input or pre-sized read/write for output.
+	Opening fails (returns false) rather than throws for anything that cannot be mapped, such as pipes,
+	empty files or platforms without mmap, so callers can fall back to streams.
+*/
+
+#ifndef __WilhelmCBC__MappedFile__
+#define __WilhelmCBC__MappedFile__
+
+#include <string>		// std::string
+#include <cstddef>		// std::size_t
+
+class MappedFile {
+public:
+// Public Methods
+	bool openRead (const std::string & filename);
+	bool openWrite (const std::string & filename, std::size_t size);
+	void close ();
+	bool close (std::size_t finalSize);	// Output maps only, truncates the file to finalSize
+
+	bool			isOpen () const;
+	unsigned char *	data () const;
+	std::size_t		size () const;
+
+// Constructors
+	MappedFile ();
+	~MappedFile ();
+
+private:
+	MappedFile (const MappedFile &);
+	MappedFile & operator= (const MappedFile &);
+
+// Private Data Members
+	int				_fd;
+	unsigned char *	_data;
+	std::size_t		_size;
+};
+
+#endif /* defined(__WilhelmCBC__MappedFile__) */
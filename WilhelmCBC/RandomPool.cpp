@@ -0,0 +1,154 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for RandomPool class
+ */
+
+#include "RandomPool.h"
+
+#include <stdexcept>	// Seeding may throw
+#include <algorithm>	// std::min
+#include <cstring>		// memcpy, memset
+#include <fstream>		// /dev/urandom fallback
+#include <atomic>		// std::atomic
+
+#if defined(__linux__)
+#  include <sys/syscall.h>	// SYS_getrandom
+#  include <unistd.h>		// syscall
+#  include <cerrno>			// EINTR
+#endif
+#if !defined(_WIN32)
+#  include <pthread.h>		// pthread_atfork
+#endif
+
+/* Counts forks, so every thread's pool notices it is running in a child */
+static std::atomic<unsigned int> forkGeneration (0);
+
+static void countFork ()
+{
+	forkGeneration++;
+}
+
+/* Fills out with bytes from the operating system, true on success */
+static bool systemRandom (unsigned char * out, std::size_t bytes)
+{
+#if defined(__linux__) && defined(SYS_getrandom)
+	std::size_t done = 0;
+	while (done < bytes)
+	{
+		long got = syscall(SYS_getrandom, out + done, bytes - done, 0);
+		if (got > 0)
+			done += (std::size_t)got;
+		else if (errno != EINTR)
+			break;
+	}
+	if (done == bytes)
+		return true;
+#endif
+
+	// Kernels without getrandom, and other systems
+	std::ifstream random;
+	random.open ("/dev/urandom", std::ios::in | std::ios::binary);
+	random.read((char*)out, bytes);
+	return random.good() && (std::size_t)random.gcount() == bytes;
+}
+
+// Public Methods
+
+// Writes bytes random bytes to out
+void RandomPool::fill (void * out, std::size_t bytes)
+{
+	RandomPool & pool = local();
+	unsigned char * dest = (unsigned char *)out;
+
+	if (pool._forkGeneration != forkGeneration)
+		pool.reseed();
+
+	while (bytes > 0)
+	{
+		if (pool._available == 0)
+			pool.refill();
+
+		std::size_t n = std::min(bytes, pool._available);
+		unsigned char * src = &pool._buffer[POOL_BYTES - pool._available];
+		memcpy(dest, src, n);
+
+		// Served bytes are not kept around
+		memset(src, 0, n);
+		pool._available -= n;
+		dest += n;
+		bytes -= n;
+	}
+}
+
+// Private Methods
+
+RandomPool & RandomPool::local ()
+{
+#if !defined(_WIN32)
+	static int registered = pthread_atfork(NULL, NULL, countFork);
+	(void)registered;
+#endif
+
+	static thread_local RandomPool pool;
+	return pool;
+}
+
+// Takes a fresh key from the operating system and drops any buffered output
+void RandomPool::reseed ()
+{
+	if (!systemRandom(&_key.data[0], SHA256::digest::size))
+		throw std::runtime_error ("COULD NOT READ SYSTEM RANDOM DATA");
+
+	_counter = 0;
+	_forkGeneration = forkGeneration;
+	_available = 0;
+	memset(_buffer, 0, POOL_BYTES);
+}
+
+// Generates POOL_BYTES of output, SHA256 (key || counter) for consecutive counters, then moves on to a new key
+void RandomPool::refill ()
+{
+	// One extra counter block becomes the next key and is never output
+	const std::size_t messageBytes = SHA256::digest::size + sizeof(uint64_t);
+	unsigned char messages[POOL_BLOCKS + 1][messageBytes];
+	const void * messagePtrs[POOL_BLOCKS + 1];
+	SHA256::digest digests[POOL_BLOCKS + 1];
+
+	for (std::size_t i = 0; i <= POOL_BLOCKS; i++)
+	{
+		memcpy(&messages[i][0], &_key.data[0], SHA256::digest::size);
+		for (unsigned int b = 0; b < sizeof(uint64_t); b++)
+			messages[i][SHA256::digest::size + b] = (unsigned char)(_counter >> (8 * b));
+		messagePtrs[i] = &messages[i][0];
+		_counter++;
+	}
+
+	SHA256::addMany(messagePtrs, messageBytes, POOL_BLOCKS + 1, digests);
+
+	for (std::size_t i = 0; i < POOL_BLOCKS; i++)
+		memcpy(&_buffer[i * SHA256::digest::size], &digests[i].data[0], SHA256::digest::size);
+	_key = digests[POOL_BLOCKS];
+	_available = POOL_BYTES;
+
+	/* Wipe temporary variables, for paranoia */
+	memset(messages, 0, sizeof(messages));
+	memset(digests, 0, sizeof(digests));
+}
+
+// Constructors
+
+RandomPool::RandomPool ()
+{
+	reseed();
+}
+
+RandomPool::~RandomPool ()
+{
+	memset(&_key.data[0], 0, SHA256::digest::size);
+	memset(_buffer, 0, POOL_BYTES);
+}
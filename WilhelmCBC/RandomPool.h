@@ -0,0 +1,59 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for RandomPool class
+
+	Random bytes for IVs and padding blocks that never block and cost no system calls once running.
+	Each thread seeds its own generator once from getrandom() (/dev/urandom where that is missing) and
+	buffers POOL_BYTES of output at a time. The generator is SHA256 in counter mode, SHA256 (key || counter),
+	and the key is replaced after every refill, so a leaked state does not reveal earlier output.
+	A forked child reseeds instead of repeating its parent's bytes.
+
+	Usage:
+	********************************
+	RandomPool::fill (buffer, bytes);
+	********************************
+*/
+
+#ifndef __WilhelmCBC__RandomPool__
+#define __WilhelmCBC__RandomPool__
+
+#include <cstddef>		// std::size_t
+#include <stdint.h>		// uint64_t
+
+#include "SHA256.h"		// Public Domain SHA256 hash function
+
+class RandomPool {
+public:
+// Public Methods
+	static void fill (void * out, std::size_t bytes);
+
+private:
+// Constants
+	static const std::size_t POOL_BLOCKS = 32;	// SHA256 outputs generated per refill
+	static const std::size_t POOL_BYTES = POOL_BLOCKS*SHA256::digest::size;
+
+// Private Methods
+	static RandomPool & local ();	// The calling thread's pool
+	void reseed ();
+	void refill ();
+
+// Constructors
+	RandomPool ();
+	~RandomPool ();
+	RandomPool (const RandomPool &);
+	RandomPool & operator= (const RandomPool &);
+
+// Private Data Members
+	SHA256::digest	_key;
+	uint64_t		_counter;
+	unsigned int	_forkGeneration;	// Reseed when this falls behind the process wide count
+	std::size_t		_available;			// Unused bytes at the end of _buffer
+	unsigned char	_buffer[POOL_BYTES];
+};
+
+#endif /* defined(__WilhelmCBC__RandomPool__) */
@@ -12,6 +12,8 @@
 
 #include "SHA256.h"
 
+#include <stdlib.h> /* for getenv */
+
 
 /* This is the *really* easy version: given a string as input, return the digest as output.
  std::cout<<"SHA-256: "<<SHA256_digest(someString).toHex()<<"\n";
@@ -76,58 +78,399 @@ SHA256::SHA256() {
 
 unsigned int ROUND_COUNT=64; // HACK
 
-/* This adds another block of data to our current state.
- This is our main transforming/mixing function. */
-void SHA256::block()
-{
-	unsigned i;
+/************** Compression engines *************/
+/* Each engine compresses blockCount whole 64 byte blocks of message data into state.
+ The fastest one the CPU supports is picked the first time a hash is computed. */
 
-	UInt32 KWi[64]; // Per-round key + work data
+/* Portable engine, used everywhere else. */
+static void compressScalar(SHA256::UInt32 state[8], const SHA256::Byte *data, size_t blockCount)
+{
+	typedef SHA256::UInt32 UInt32;
 
-	// First part of W is just the incoming message data */
 #define s0(x) (ror(x, 7) ^ ror(x,18) ^ (x >> 3))
 #define s1(x) (ror(x,17) ^ ror(x,19) ^ (x >> 10))
-	UInt32 W[16]; // Work buffer: 0-15 are straight from the data
-	for (i = 0; i < 16; i++) {
-		W[i]=
-		((UInt32)(buffer[i * 4    ]) << 24) +
-		((UInt32)(buffer[i * 4 + 1]) << 16) +
-		((UInt32)(buffer[i * 4 + 2]) <<  8) +
-		((UInt32)(buffer[i * 4 + 3])); // big-endian 32-bit load
-		KWi[i]=W[i]+K[i];
+	UInt32 W[16]; // Work buffer: rolling window of the message schedule
+
+	for (; blockCount > 0; blockCount--, data += 64)
+	{
+		UInt32 a,b,c,d,e,f,g,h; /* local copies of state, for performance */
+		a=state[0]; b=state[1];  c=state[2];  d=state[3];
+		e=state[4]; f=state[5];  g=state[6];  h=state[7];
+
+		// This is the main data transform loop. The schedule is extended as the rounds consume it,
+		//  instead of being computed up front into a 64 entry per-round key + work table.
+		for (unsigned i = 0; i < ROUND_COUNT; i++) {
+			UInt32 KWi; // Per-round key + work data
+			if (i < 16) // First part of W is just the incoming message data
+				W[i]=
+				((UInt32)(data[i * 4    ]) << 24) +
+				((UInt32)(data[i * 4 + 1]) << 16) +
+				((UInt32)(data[i * 4 + 2]) <<  8) +
+				((UInt32)(data[i * 4 + 3])); // big-endian 32-bit load
+			else // The rest of W is a scrambled copy of the original data
+				W[i&15] += s1(W[(i-2)&15]) + W[(i-7)&15] + s0(W[(i-15)&15]);
+			KWi = W[i&15]+K[i];
+
+			// SHA-256 round function:
+			// Mixing
+			h += (ror(e,6)^ror(e,11)^ror(e,25)) + (g^(e&(f^g))) + KWi; // "Ch"
+			d += h;
+			h += (ror(a,2)^ror(a,13)^ror(a,22)) + ((a&b)|(c&(a|b))); // "Maj"
+
+			// Cyclic shift of variables:
+			UInt32 old_h=h;
+			h=g; g=f; f=e; e=d; d=c; c=b; b=a; a=old_h;
+		}
+
+		// Add result back into state array
+		state[0]+=a; state[1]+=b;  state[2]+=c;  state[3]+=d;
+		state[4]+=e; state[5]+=f;  state[6]+=g;  state[7]+=h;
+	}
+
+	/* Wipe temporary variables, for paranoia */
+	memset(W, 0, sizeof(W));
+#undef s0
+#undef s1
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#  define SHA256_HAVE_SHANI 1
+#  include <cpuid.h>
+#  include <immintrin.h>
+
+/* Intel SHA extensions engine. Two rounds per sha256rnds2, with the state kept as ABEF/CDGH register pairs. */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void compressSHANI(SHA256::UInt32 state[8], const SHA256::Byte *data, size_t blockCount)
+{
+	const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+	// Rearrange state from ABCD EFGH into ABEF CDGH
+	__m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);	// CDAB
+	__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);	// EFGH
+	__m128i state0 = _mm_alignr_epi8(tmp, state1, 8);		// ABEF
+	state1 = _mm_blend_epi16(state1, tmp, 0xF0);			// CDGH
+
+	for (; blockCount > 0; blockCount--, data += 64)
+	{
+		__m128i abefSave = state0;
+		__m128i cdghSave = state1;
+
+		// Message schedule, four words per register, as a ring of four registers
+		__m128i msg[4];
+		for (int i = 0; i < 4; i++)
+			msg[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16*i)), byteSwap);
+
+		for (int group = 0; group < 16; group++)
+		{
+			__m128i kw = _mm_add_epi32(msg[group&3], _mm_loadu_si128((const __m128i *)&K[4*group]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, kw);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(kw, 0x0E));
+
+			// Words 4*group+16 .. 4*group+19, replacing the ones just consumed
+			if (group < 12)
+				msg[group&3] = _mm_sha256msg2_epu32(
+					_mm_add_epi32(_mm_sha256msg1_epu32(msg[group&3], msg[(group+1)&3]),
+								  _mm_alignr_epi8(msg[(group+3)&3], msg[(group+2)&3], 4)),
+					msg[(group+3)&3]);
+		}
+
+		state0 = _mm_add_epi32(state0, abefSave);
+		state1 = _mm_add_epi32(state1, cdghSave);
+	}
+
+	// Back to ABCD EFGH
+	tmp = _mm_shuffle_epi32(state0, 0x1B);				// FEBA
+	state1 = _mm_shuffle_epi32(state1, 0xB1);			// DCHG
+	state0 = _mm_blend_epi16(tmp, state1, 0xF0);		// DCBA
+	state1 = _mm_alignr_epi8(state1, tmp, 8);			// HGFE
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+/* SHA extensions are CPUID leaf 7 EBX bit 29, and the engine also needs SSSE3 and SSE4.1 (leaf 1 ECX bits 9 and 19). */
+static bool cpuHasSHANI()
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 9)) || !(ecx & (1u << 19)))
+		return false;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return false;
+	return (ebx & (1u << 29)) != 0;
+}
+#endif
+
+/************** Multi-lane engines *************/
+/* Hash several independent, equal length messages at once, one message per vector lane.
+ Written once with GCC vector extensions, and instantiated below for each vector width. */
+#if defined(__GNUC__) || defined(__clang__)
+#  define SHA256_HAVE_LANES 1
+
+/* One 64 byte block of every lane. state[j] holds word j of every lane's state. */
+template <class V, int LANES>
+static inline __attribute__((always_inline)) void compressLanes(V state[8], const SHA256::Byte * const *blocks)
+{
+	typedef SHA256::UInt32 UInt32;
+#define vror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+	V W[16];
+	for (int i = 0; i < 16; i++)
+		for (int lane = 0; lane < LANES; lane++)
+		{
+			const SHA256::Byte *p = blocks[lane] + i * 4;
+			W[i][lane] = ((UInt32)p[0] << 24) | ((UInt32)p[1] << 16) | ((UInt32)p[2] << 8) | (UInt32)p[3]; // big-endian 32-bit load
+		}
+
+	V a=state[0], b=state[1], c=state[2], d=state[3];
+	V e=state[4], f=state[5], g=state[6], h=state[7];
+
+	for (int i = 0; i < 64; i++)
+	{
+		if (i >= 16)
+			W[i&15] += (vror(W[(i-2)&15],17) ^ vror(W[(i-2)&15],19) ^ (W[(i-2)&15] >> 10)) + W[(i-7)&15]
+					 + (vror(W[(i-15)&15],7) ^ vror(W[(i-15)&15],18) ^ (W[(i-15)&15] >> 3));
+
+		V t1 = h + (vror(e,6) ^ vror(e,11) ^ vror(e,25)) + (g ^ (e & (f ^ g))) + K[i] + W[i&15]; // "Ch"
+		V t2 = (vror(a,2) ^ vror(a,13) ^ vror(a,22)) + ((a & b) | (c & (a | b))); // "Maj"
+		h=g; g=f; f=e; e=d+t1; d=c; c=b; b=a; a=t1+t2;
 	}
 
-	// The rest of W is a scrambled copy of the original data
-	for (;i<ROUND_COUNT;i++)
+	state[0]+=a; state[1]+=b; state[2]+=c; state[3]+=d;
+	state[4]+=e; state[5]+=f; state[6]+=g; state[7]+=h;
+#undef vror
+}
+
+/* Hashes LANES messages of messageSize bytes into LANES digests */
+template <class V, int LANES>
+static inline __attribute__((always_inline)) void hashLanes(const void * const *messages, size_t messageSize, SHA256::digest *digests)
+{
+	static const SHA256::UInt32 initial[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	V state[8];
+	for (int j = 0; j < 8; j++)
+		for (int lane = 0; lane < LANES; lane++)
+			state[j][lane] = initial[j];
+
+	// Whole blocks straight from the messages
+	const SHA256::Byte *blocks[LANES];
+	size_t fullBlocks = messageSize / 64;
+	for (size_t block = 0; block < fullBlocks; block++)
 	{
-		W[i&15] += s1(W[(i-2)&15]) + W[(i-7)&15] + s0(W[(i-15)&15]);
-		KWi[i] = W[i&15]+K[i];
+		for (int lane = 0; lane < LANES; lane++)
+			blocks[lane] = (const SHA256::Byte *)messages[lane] + block * 64;
+		compressLanes<V, LANES>(state, blocks);
 	}
 
-	UInt32 a,b,c,d,e,f,g,h; /* local copies of state, for performance */
-	a=state[0]; b=state[1];  c=state[2];  d=state[3];
-	e=state[4]; f=state[5];  g=state[6];  h=state[7];
-
-	// This is the main data transform loop
-	for (i = 0; i < ROUND_COUNT; i++) {
-		// SHA-256 round function:
-		// Mixing
-		h += (ror(e,6)^ror(e,11)^ror(e,25)) + (g^(e&(f^g))) + KWi[i]; // "Ch"
-		d += h;
-		h += (ror(a,2)^ror(a,13)^ror(a,22)) + ((a&b)|(c&(a|b))); // "Maj"
-
-		// Cyclic shift of variables:
-		UInt32 old_h=h;
-		h=g; g=f; f=e; e=d; d=c; c=b; b=a; a=old_h;
+	// Standard padding, the same shape for every lane since the lengths match
+	size_t tail = messageSize % 64;
+	size_t padBlocks = (tail < 56) ? 1 : 2;
+	size_t lenInBits = messageSize << 3;
+	SHA256::Byte padded[LANES][128];
+	for (int lane = 0; lane < LANES; lane++)
+	{
+		memcpy(padded[lane], (const SHA256::Byte *)messages[lane] + fullBlocks * 64, tail);
+		padded[lane][tail] = 0x80;
+		memset(&padded[lane][tail + 1], 0, padBlocks * 64 - tail - 1);
+		for (int i = 0; i < 8; i++)
+			padded[lane][padBlocks * 64 - 1 - i] = (SHA256::Byte)(lenInBits >> (8 * i));
+	}
+	for (size_t block = 0; block < padBlocks; block++)
+	{
+		for (int lane = 0; lane < LANES; lane++)
+			blocks[lane] = padded[lane] + block * 64;
+		compressLanes<V, LANES>(state, blocks);
 	}
 
-	// Add result back into state array
-	state[0]+=a; state[1]+=b;  state[2]+=c;  state[3]+=d;
-	state[4]+=e; state[5]+=f;  state[6]+=g;  state[7]+=h;
+	// Copy state out as big-endian integers.
+	for (int lane = 0; lane < LANES; lane++)
+		for (int j = 0; j < 8; j++)
+		{
+			digests[lane].data[j*4+0] = (SHA256::Byte)(state[j][lane] >> 24);
+			digests[lane].data[j*4+1] = (SHA256::Byte)(state[j][lane] >> 16);
+			digests[lane].data[j*4+2] = (SHA256::Byte)(state[j][lane] >> 8);
+			digests[lane].data[j*4+3] = (SHA256::Byte)(state[j][lane]);
+		}
 
 	/* Wipe temporary variables, for paranoia */
-	memset(W, 0, sizeof(W));
-	memset(KWi, 0, sizeof(KWi));
+	memset(padded, 0, sizeof(padded));
+}
+
+/* 4 lanes: SSE2 on x86-64, or whatever 128 bit vectors the target has */
+static void hashLanes4(const void * const *messages, size_t messageSize, SHA256::digest *digests)
+{
+	typedef SHA256::UInt32 V4 __attribute__((vector_size(16)));
+	hashLanes<V4, 4>(messages, messageSize, digests);
+}
+
+#  if defined(__x86_64__) || defined(__i386__)
+/* 8 lanes */
+__attribute__((target("avx2")))
+static void hashLanesAVX2(const void * const *messages, size_t messageSize, SHA256::digest *digests)
+{
+	typedef SHA256::UInt32 V8 __attribute__((vector_size(32)));
+	hashLanes<V8, 8>(messages, messageSize, digests);
+}
+
+/* 16 lanes */
+__attribute__((target("avx512f")))
+static void hashLanesAVX512(const void * const *messages, size_t messageSize, SHA256::digest *digests)
+{
+	typedef SHA256::UInt32 V16 __attribute__((vector_size(64)));
+	hashLanes<V16, 16>(messages, messageSize, digests);
+}
+
+/* AVX2 is CPUID leaf 7 EBX bit 5, AVX-512F bit 16. Both also need the OS to save the wider registers (XGETBV). */
+static bool cpuHasVectorState(unsigned int xcrMask)
+{
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & (1u << 27))) // OSXSAVE
+		return false;
+	unsigned int xcr0, xcr0High;
+	__asm__ ("xgetbv" : "=a"(xcr0), "=d"(xcr0High) : "c"(0));
+	return (xcr0 & xcrMask) == xcrMask;
+}
+static bool cpuHasAVX2()
+{
+	unsigned int eax, ebx, ecx, edx;
+	return cpuHasVectorState(0x06) && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 5));
+}
+static bool cpuHasAVX512()
+{
+	unsigned int eax, ebx, ecx, edx;
+	return cpuHasVectorState(0xE6) && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 16));
+}
+#  endif
+#endif
+
+struct SHA256Engine {
+	const char *name;
+	SHA256::CompressFunction compress;
+	bool (*supported)();
+};
+
+static bool alwaysSupported() { return true; }
+
+/* In order of preference */
+static const SHA256Engine engines[] = {
+#ifdef SHA256_HAVE_SHANI
+	{"sha-ni", compressSHANI, cpuHasSHANI},
+#endif
+	{"scalar", compressScalar, alwaysSupported}
+};
+
+/* The first supported engine, unless WILHELMCBC_SHA256 names another. */
+static const SHA256Engine *defaultEngine()
+{
+	const SHA256Engine *engine = 0;
+	for (size_t i = 0; i < sizeof(engines)/sizeof(engines[0]) && !engine; i++)
+		if (engines[i].supported())
+			engine = &engines[i];
+
+	const char *requested = getenv("WILHELMCBC_SHA256");
+	for (size_t i = 0; requested && i < sizeof(engines)/sizeof(engines[0]); i++)
+		if (strcmp(requested, engines[i].name) == 0 && engines[i].supported())
+			engine = &engines[i];
+	return engine;
+}
+
+/* The engine in use, picked by defaultEngine on the first call from any thread (static initialization is thread safe). */
+static const SHA256Engine *&currentEngine()
+{
+	static const SHA256Engine *engine = defaultEngine();
+	return engine;
+}
+
+SHA256::CompressFunction SHA256::compress()
+{
+	return currentEngine()->compress;
+}
+
+const char *SHA256::engineName()
+{
+	return currentEngine()->name;
+}
+
+/* Switch engines by name, for testing and benchmarks. Fails if the CPU cannot run it. */
+bool SHA256::setEngine(const std::string &name)
+{
+	for (size_t i = 0; i < sizeof(engines)/sizeof(engines[0]); i++)
+		if (name == engines[i].name && engines[i].supported())
+		{
+			currentEngine() = &engines[i];
+			return true;
+		}
+	return false;
+}
+
+struct SHA256LaneEngine {
+	const char *name;
+	unsigned int lanes;
+	SHA256::ManyFunction hashMany;
+	bool (*supported)();
+};
+
+/* Widest first */
+static const SHA256LaneEngine laneEngines[] = {
+#if defined(SHA256_HAVE_LANES) && (defined(__x86_64__) || defined(__i386__))
+	{"avx512", 16, hashLanesAVX512, cpuHasAVX512},
+	{"avx2", 8, hashLanesAVX2, cpuHasAVX2},
+#endif
+#ifdef SHA256_HAVE_LANES
+	{"4-lane", 4, hashLanes4, alwaysSupported},
+#endif
+	{"none", 1, 0, alwaysSupported}
+};
+
+/* The lane engine addMany starts with: the widest supported one. With the SHA extensions only 16 lanes pay off,
+ a single SHA-NI stream keeps up with 8 AVX2 lanes. WILHELMCBC_SHA256_LANES names another. */
+static const SHA256LaneEngine *defaultLaneEngine()
+{
+	const size_t count = sizeof(laneEngines)/sizeof(laneEngines[0]);
+	const SHA256LaneEngine *engine = &laneEngines[count - 1];
+	const unsigned int minimumLanes = (currentEngine()->compress == compressScalar) ? 2 : 16;
+	for (size_t i = 0; i < count && engine->lanes == 1; i++)
+		if (laneEngines[i].lanes >= minimumLanes && laneEngines[i].supported())
+			engine = &laneEngines[i];
+
+	const char *requested = getenv("WILHELMCBC_SHA256_LANES");
+	for (size_t i = 0; requested && i < count; i++)
+		if (strcmp(requested, laneEngines[i].name) == 0 && laneEngines[i].supported())
+			engine = &laneEngines[i];
+	return engine;
+}
+
+/* The lane engine in use, picked once like currentEngine. currentEngine is itself initialized by then. */
+static const SHA256LaneEngine *&currentLaneEngine()
+{
+	static const SHA256LaneEngine *engine = defaultLaneEngine();
+	return engine;
+}
+
+unsigned int SHA256::lanes()
+{
+	return currentLaneEngine()->lanes;
+}
+
+const char *SHA256::laneEngineName()
+{
+	return currentLaneEngine()->name;
+}
+
+bool SHA256::setLaneEngine(const std::string &name)
+{
+	for (size_t i = 0; i < sizeof(laneEngines)/sizeof(laneEngines[0]); i++)
+		if (name == laneEngines[i].name && laneEngines[i].supported())
+		{
+			currentLaneEngine() = &laneEngines[i];
+			return true;
+		}
+	return false;
+}
+
+/* This adds another block of data to our current state.
+ This is our main transforming/mixing function. */
+void SHA256::block()
+{
+	compress()(state, buffer, 1);
 }
 
 
@@ -136,16 +479,52 @@ void SHA256::add(const void *data, size_t size)
 {
 	const Byte *dataptr=(const Byte *)data;
 	UInt32 curBufferPos = (UInt32)count & 0x3F; /* location within last block */
-	while (size > 0)
+	count += size; // message got longer
+
+	// Top up a partly filled buffer first
+	if (curBufferPos > 0)
 	{
-		buffer[curBufferPos++] = *dataptr++; // copy next byte of data
-		count++; // message got longer
-		size--; // user data got shorter
-		if (curBufferPos == 64) // we have one whole block finished
-		{
-			curBufferPos = 0;
-			block();
-		}
+		size_t fill = 64 - curBufferPos;
+		if (fill > size)
+			fill = size;
+		memcpy(&buffer[curBufferPos], dataptr, fill);
+		dataptr += fill;
+		size -= fill;
+		if (curBufferPos + fill < 64)
+			return; // still no whole block
+		block();
+	}
+
+	// Whole blocks are compressed straight from the caller's memory
+	size_t blockCount = size / 64;
+	if (blockCount > 0)
+	{
+		compress()(state, dataptr, blockCount);
+		dataptr += blockCount * 64;
+		size -= blockCount * 64;
+	}
+
+	// Keep the tail for next time
+	memcpy(buffer, dataptr, size);
+}
+
+/* Hashes messageCount separate messages of messageSize bytes each, writing one digest per message.
+ Saves setting up and tearing down a hash object per message, e.g. for the clusters of a file. */
+void SHA256::addMany(const void * const *messages, size_t messageSize, size_t messageCount, SHA256::digest *digests)
+{
+	// Full sets of lanes go through the vector engine
+	const SHA256LaneEngine *engine = currentLaneEngine();
+	size_t i = 0;
+	if (engine->lanes > 1)
+		for (; i + engine->lanes <= messageCount; i += engine->lanes)
+			engine->hashMany(&messages[i], messageSize, &digests[i]);
+
+	// The rest one at a time
+	SHA256 hash;
+	for (; i < messageCount; i++)
+	{
+		hash.add(messages[i], messageSize);
+		digests[i] = hash.finish();
 	}
 }
 
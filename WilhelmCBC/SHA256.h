@@ -64,6 +64,9 @@ public:
 	// Resets so you can add the next message, if desired.
 	SHA256::digest finish(void);
 
+	// Hash messageCount independent messages, all messageSize bytes long, into digests[0..messageCount).
+	static void addMany(const void * const *messages, size_t messageSize, size_t messageCount, SHA256::digest *digests);
+
 	~SHA256(); // destructor.  Clears out state and buffered data.
 
 	/* Internal Interface (public, for debug's sake) */
@@ -82,6 +85,22 @@ public:
 
 	// Process the finished block of data in "buffer"
 	void block();
+
+	/* Compression engine: folds blockCount whole 64 byte blocks into state.
+	 Picked at runtime from what the CPU supports (SHA extensions, else portable code).
+ setEngine is for tests and benchmarks, and not safe while other threads hash. */
+	typedef void (*CompressFunction)(UInt32 state[8], const Byte *data, size_t blockCount);
+	static CompressFunction compress();
+	static const char *engineName();
+	static bool setEngine(const std::string &name);
+
+	/* Multi-lane engine behind addMany: hashes lanes() messages at once, one per vector lane (AVX-512, AVX2, 4 lanes).
+	 lanes() is 1 when single messages are faster, e.g. with the SHA extensions. Callers batch lanes() messages at a time.
+ setLaneEngine, like setEngine, is not safe while other threads hash. */
+	typedef void (*ManyFunction)(const void * const *messages, size_t messageSize, SHA256::digest *digests);
+	static unsigned int lanes();
+	static const char *laneEngineName();
+	static bool setLaneEngine(const std::string &name);
 };
 
 
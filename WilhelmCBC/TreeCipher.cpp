@@ -0,0 +1,236 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for TreeCipher class
+ */
+
+#include "TreeCipher.h"
+
+#include <algorithm>	// std::sort
+#include <stdexcept>	// std::runtime_error
+#include <exception>	// std::exception
+#include <fstream>		// std::ofstream
+#include <cerrno>		// errno
+
+#include <dirent.h>		// opendir, readdir
+#include <sys/stat.h>	// lstat, mkdir
+#include <unistd.h>		// unlink
+
+// Public Methods
+
+TreeCipher::Totals TreeCipher::encrypt (const std::string & inputRoot, const std::string & outputRoot, std::ostream & errors)
+{
+	return run(true, inputRoot, outputRoot, errors);
+}
+
+TreeCipher::Totals TreeCipher::decrypt (const std::string & inputRoot, const std::string & outputRoot, std::ostream & errors)
+{
+	return run(false, inputRoot, outputRoot, errors);
+}
+
+// Cluster size every file is encrypted with
+void TreeCipher::setClusterSize (std::size_t clusterBytes)
+{
+	for (std::size_t i = 0; i < _workers.size(); i++)
+		_workers[i]->setClusterSize(clusterBytes);
+}
+
+void TreeCipher::setIOBackend (WilhelmCBC::IOBackend backend)
+{
+	for (std::size_t i = 0; i < _workers.size(); i++)
+		_workers[i]->setIOBackend(backend);
+}
+
+// Whether encrypted files end in a footer index
+void TreeCipher::setIndex (bool index)
+{
+	for (std::size_t i = 0; i < _workers.size(); i++)
+		_workers[i]->setIndex(index);
+}
+
+// Mode every file is encrypted with
+void TreeCipher::setCipherMode (WilhelmCBC::CipherMode mode)
+{
+	_mode = mode;
+	for (std::size_t i = 0; i < _workers.size(); i++)
+		_workers[i]->setCipherMode(mode);
+}
+
+// Integrity hash every file is encrypted with
+void TreeCipher::setIntegrityMode (HashTree::Mode mode)
+{
+	for (std::size_t i = 0; i < _workers.size(); i++)
+		_workers[i]->setIntegrityMode(mode);
+}
+
+// Constructors
+
+TreeCipher::TreeCipher (const std::string & password, unsigned int threads)
+	: _threads (threads ? threads : 1), _mode (WilhelmCBC::MODE_CBC), _pool (_threads)
+{
+	for (unsigned int i = 0; i < _pool.size(); i++)
+	{
+		_workers.push_back(std::unique_ptr<WilhelmCBC> (new WilhelmCBC));
+		_workers[i]->setKey(password);
+		_workers[i]->setThreads(1);
+	}
+}
+
+// Private Methods
+
+bool TreeCipher::TreeFile::operator< (const TreeFile & rhs) const
+{
+	return size > rhs.size;
+}
+
+// Mirrors the directories of inputRoot under outputRoot, then encrypts or decrypts every file into them
+TreeCipher::Totals TreeCipher::run (bool encrypting, const std::string & inputRoot, const std::string & outputRoot, std::ostream & errors)
+{
+	std::vector<TreeFile> files;
+	walk(inputRoot, outputRoot, "", files);
+	std::sort(files.begin(), files.end());
+
+	Totals totals = Totals();
+	totals.files = files.size();
+
+	// Files ahead of firstShared are done one at a time with every thread, see header
+	std::size_t firstShared = 0;
+	if ((!encrypting || _mode == WilhelmCBC::MODE_XEX) && _threads > 1)
+		while (firstShared < files.size() && files[firstShared].size >= (std::size_t)PARALLEL_BATCH_BYTES*_threads)
+			firstShared++;
+
+	_workers[0]->setThreads(_threads);
+	for (std::size_t i = 0; i < firstShared; i++)
+	{
+		if (!runFile(*_workers[0], encrypting, inputRoot + files[i].relativePath, outputRoot + files[i].relativePath, files[i].size,
+					 errors, totals.bytes))
+			totals.failed++;
+	}
+	_workers[0]->setThreads(1);
+
+	// The rest a file per worker
+	std::vector<std::size_t> workerBytes (_pool.size(), 0);
+	std::vector<std::size_t> workerFailed (_pool.size(), 0);
+
+	_pool.parallelForStealing(files.size()-firstShared, [&] (std::size_t index, unsigned int worker)
+	{
+		const TreeFile & file = files[firstShared + index];
+		if (!runFile(*_workers[worker], encrypting, inputRoot + file.relativePath, outputRoot + file.relativePath, file.size,
+					 errors, workerBytes[worker]))
+			workerFailed[worker]++;
+	});
+
+	for (std::size_t i = 0; i < workerBytes.size(); i++)
+	{
+		totals.bytes += workerBytes[i];
+		totals.failed += workerFailed[i];
+	}
+
+	return totals;
+}
+
+// Adds the regular files under inputRoot + relativePath to files, creating each directory under outputRoot on the way
+void TreeCipher::walk (const std::string & inputRoot, const std::string & outputRoot, const std::string & relativePath,
+					   std::vector<TreeFile> & files)
+{
+	// The output tree may sit inside the input tree, and is not walked or mirrored into itself
+	struct stat inputInfo, outputInfo;
+	if (!relativePath.empty() && lstat((inputRoot + relativePath).c_str(), &inputInfo) == 0
+		&& lstat(outputRoot.c_str(), &outputInfo) == 0
+		&& inputInfo.st_dev == outputInfo.st_dev && inputInfo.st_ino == outputInfo.st_ino)
+		return;
+
+	std::string outputDirectory = outputRoot + relativePath;
+	if (mkdir(outputDirectory.c_str(), 0777) != 0 && errno != EEXIST)
+		throw std::runtime_error ("COULD NOT CREATE OUTPUT DIRECTORY " + outputDirectory);
+
+	DIR * directory = opendir((inputRoot + relativePath).c_str());
+	if (!directory)
+		throw std::runtime_error ("COULD NOT OPEN INPUT DIRECTORY " + inputRoot + relativePath);
+
+	std::vector<std::string> subdirectories;
+	while (dirent * entry = readdir(directory))
+	{
+		std::string name = entry->d_name;
+		if (name == "." || name == "..")
+			continue;
+
+		std::string entryPath = relativePath + "/" + name;
+		struct stat info;
+		if (lstat((inputRoot + entryPath).c_str(), &info) != 0)
+			continue;
+
+		if (S_ISDIR(info.st_mode))
+			subdirectories.push_back(entryPath);
+		else if (S_ISREG(info.st_mode))
+		{
+			TreeFile file = {entryPath, (std::size_t)info.st_size};
+			files.push_back(file);
+		}
+	}
+	closedir(directory);
+
+	for (std::size_t i = 0; i < subdirectories.size(); i++)
+		walk(inputRoot, outputRoot, subdirectories[i], files);
+}
+
+// Encrypts or decrypts one file of inputSize bytes, adding its size to bytes. Returns false on any error or HMAC mismatch,
+//	after removing whatever output it started.
+// Empty files have nothing to encrypt, and are mirrored as empty files both ways.
+bool TreeCipher::runFile (WilhelmCBC & cipherObj, bool encrypting, const std::string & input, const std::string & output,
+						  std::size_t inputSize, std::ostream & errors, std::size_t & bytes)
+{
+	std::string error;
+	bool outputStarted = false;
+	try
+	{
+		if (inputSize == 0)
+		{
+			outputStarted = true;
+			std::ofstream empty (output.c_str(), std::ios::binary | std::ios::trunc);
+			if (!empty)
+				throw std::runtime_error ("COULD NOT OPEN OUTPUT FILE");
+			return true;
+		}
+
+		cipherObj.setInput(input);
+		outputStarted = true;
+		cipherObj.setOutput(output);
+
+		if (encrypting)
+			cipherObj.encrypt();
+		else if (!cipherObj.decrypt())
+			error = "Unsuccessful decryption - HMAC failed";
+
+		if (error.empty())
+		{
+			bytes += cipherObj.getSize();
+			return true;
+		}
+	}
+
+	catch (std::runtime_error & e) {
+		error = e.what();
+	}
+
+	catch (std::bad_alloc &) {
+		error = "Allocation Error - Sufficient memory might not be available.";
+	}
+
+	// Anything else still only fails this file, an exception escaping a pool task would end the process
+	catch (std::exception & e) {
+		error = e.what();
+	}
+
+	// unlink, not remove, so a directory in the way is never taken out
+	if (outputStarted)
+		unlink(output.c_str());
+
+	std::lock_guard<std::mutex> lock (_errorsMutex);
+	errors << input << ": " << error << "\n";
+	return false;
+}
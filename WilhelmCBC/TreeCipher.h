@@ -0,0 +1,89 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for TreeCipher class
+
+	Encrypts or decrypts every regular file under an input directory into the same relative path under an
+	output directory, creating the directories as needed. Symbolic links and special files are skipped.
+
+	Files are sorted largest first and spread over a WorkerPool with parallelForStealing, so huge files start
+	early and tiny ones fill in the gaps. Each worker keeps its own WilhelmCBC, keyed once, for every file it takes.
+	When decrypting, or encrypting with MODE_XEX, files big enough to give every thread a batch (PARALLEL_BATCH_BYTES
+	each) are instead done one at a time beforehand, with their clusters split across all threads.
+
+	Errors in single files are reported to the errors stream and counted, their output removed, and the rest of the tree
+	carries on. Empty files are copied across as empty files, encrypting or decrypting, since there is no empty ciphertext.
+
+	Usage:
+	********************************
+	TreeCipher tree (password, threads);
+	TreeCipher::Totals totals = tree.encrypt (inputDirectory, outputDirectory, std::cerr);
+	********************************
+*/
+
+#ifndef __WilhelmCBC__TreeCipher__
+#define __WilhelmCBC__TreeCipher__
+
+#include <string>		// std::string
+#include <vector>		// std::vector
+#include <ostream>		// std::ostream
+#include <memory>		// std::unique_ptr
+
+#include "WilhelmCBC.h"	// Per worker cipher
+#include "WorkerPool.h"	// Work stealing over files
+
+class TreeCipher {
+public:
+// Types
+	// Totals, what a whole tree came to
+	struct Totals {
+		std::size_t	files;	// Regular files found
+		std::size_t	failed;	// Files that threw, or failed their HMAC
+		std::size_t	bytes;	// Input bytes of the files that succeeded
+	};
+
+// Public Methods
+	Totals encrypt (const std::string & inputRoot, const std::string & outputRoot, std::ostream & errors);
+	Totals decrypt (const std::string & inputRoot, const std::string & outputRoot, std::ostream & errors);
+
+	void setClusterSize (std::size_t clusterBytes);
+	void setIOBackend (WilhelmCBC::IOBackend backend);
+	void setIndex (bool index);
+	void setCipherMode (WilhelmCBC::CipherMode mode);
+	void setIntegrityMode (HashTree::Mode mode);
+
+// Constructors
+	TreeCipher (const std::string & password, unsigned int threads);
+
+private:
+// Types
+	// TreeFile, one regular file of the tree
+	struct TreeFile {
+		std::string	relativePath;
+		std::size_t	size;
+		bool operator< (const TreeFile & rhs) const;	// Largest first
+	};
+
+	TreeCipher (const TreeCipher &);
+	TreeCipher & operator= (const TreeCipher &);
+
+// Private Methods
+	Totals run (bool encrypting, const std::string & inputRoot, const std::string & outputRoot, std::ostream & errors);
+	void walk (const std::string & inputRoot, const std::string & outputRoot, const std::string & relativePath,
+			   std::vector<TreeFile> & files);
+	bool runFile (WilhelmCBC & cipherObj, bool encrypting, const std::string & input, const std::string & output,
+				  std::size_t inputSize, std::ostream & errors, std::size_t & bytes);
+
+// Private Data Members
+	unsigned int	_threads;
+	WilhelmCBC::CipherMode	_mode;
+	WorkerPool		_pool;
+	std::vector<std::unique_ptr<WilhelmCBC> >	_workers;	// One per pool worker
+	std::mutex		_errorsMutex;
+};
+
+#endif /* defined(__WilhelmCBC__TreeCipher__) */
@@ -0,0 +1,458 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for UringIO class
+ */
+
+#include "UringIO.h"
+
+#include <stdexcept>	// run may throw
+#include <algorithm>	// std::max
+#include <cstring>		// memset
+
+#if defined(__linux__)
+#  include <sys/syscall.h>	// __NR_io_uring_*
+#  if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#    define WILHELMCBC_HAVE_URING 1
+#    include <linux/io_uring.h>	// Ring layout and opcodes
+#    include <sys/mman.h>		// mmap
+#    include <sys/stat.h>		// fstat
+#    include <sys/uio.h>		// iovec
+#    include <fcntl.h>			// open
+#    include <unistd.h>			// pread, pwrite, close
+#    include <cerrno>			// EINTR
+#  endif
+#endif
+
+#if defined(WILHELMCBC_HAVE_URING)
+
+/* Submission and completion rings of one io_uring instance, shared with the kernel */
+struct UringIO::Ring {
+	int					fd;
+	unsigned char *		sqRing;
+	std::size_t			sqRingBytes;
+	unsigned char *		cqRing;
+	std::size_t			cqRingBytes;
+	io_uring_sqe *		sqes;
+	std::size_t			sqesBytes;
+	unsigned int *		sqTail;
+	unsigned int *		sqMask;
+	unsigned int *		sqArray;
+	unsigned int *		cqHead;
+	unsigned int *		cqTail;
+	unsigned int *		cqMask;
+	io_uring_cqe *		cqes;
+	unsigned int		toSubmit;
+
+	Ring () : fd (-1), sqRing (NULL), cqRing (NULL), sqes (NULL), toSubmit (0) {}
+	~Ring () { close(); }
+
+	bool open (unsigned int entries)
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+		if (fd < 0)
+			return false;
+
+		sqRingBytes = params.sq_off.array + params.sq_entries*sizeof(unsigned int);
+		cqRingBytes = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+		sqesBytes = params.sq_entries*sizeof(io_uring_sqe);
+
+		// Newer kernels share one mapping between both rings
+		bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single)
+			sqRingBytes = cqRingBytes = std::max(sqRingBytes, cqRingBytes);
+
+		void * sq = mmap(NULL, sqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sq == MAP_FAILED)
+			return close(), false;
+		sqRing = (unsigned char *)sq;
+
+		void * cq = single ? sq : mmap(NULL, cqRingBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return close(), false;
+		cqRing = (unsigned char *)cq;
+
+		void * entriesMap = mmap(NULL, sqesBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (entriesMap == MAP_FAILED)
+			return close(), false;
+		sqes = (io_uring_sqe *)entriesMap;
+
+		sqTail = (unsigned int *)(sqRing + params.sq_off.tail);
+		sqMask = (unsigned int *)(sqRing + params.sq_off.ring_mask);
+		sqArray = (unsigned int *)(sqRing + params.sq_off.array);
+		cqHead = (unsigned int *)(cqRing + params.cq_off.head);
+		cqTail = (unsigned int *)(cqRing + params.cq_off.tail);
+		cqMask = (unsigned int *)(cqRing + params.cq_off.ring_mask);
+		cqes = (io_uring_cqe *)(cqRing + params.cq_off.cqes);
+		return true;
+	}
+
+	void close ()
+	{
+		if (sqes)
+			munmap(sqes, sqesBytes);
+		if (cqRing && cqRing != sqRing)
+			munmap(cqRing, cqRingBytes);
+		if (sqRing)
+			munmap(sqRing, sqRingBytes);
+		if (fd >= 0)
+			::close(fd);
+
+		fd = -1;
+		sqRing = cqRing = NULL;
+		sqes = NULL;
+		toSubmit = 0;
+	}
+
+	// Next free submission entry, zeroed. Only this thread produces, so the tail is ours to move.
+	io_uring_sqe * nextEntry ()
+	{
+		unsigned int tail = *sqTail;
+		unsigned int index = tail & *sqMask;
+		io_uring_sqe * entry = &sqes[index];
+		memset(entry, 0, sizeof(*entry));
+		sqArray[index] = index;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		toSubmit++;
+		return entry;
+	}
+
+	// Submits queued entries, waiting for at least minComplete completions
+	void enter (unsigned int minComplete)
+	{
+		for (;;)
+		{
+			long submitted = syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+			if (submitted >= 0)
+			{
+				toSubmit -= (unsigned int)submitted;
+				return;
+			}
+			if (errno != EINTR)
+				throw std::runtime_error ("IO_URING SUBMISSION FAILED");
+		}
+	}
+};
+
+#endif
+
+// Public Methods
+
+// Opens a regular file for reading through io_uring
+bool UringIO::openInput (const std::string & filename)
+{
+	closeInput();
+
+#if defined(WILHELMCBC_HAVE_URING)
+	if (!available())
+		return false;
+
+	_inputFd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (_inputFd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(_inputFd, &info) != 0 || !S_ISREG(info.st_mode))
+	{
+		closeInput();
+		return false;
+	}
+	return true;
+#else
+	(void)filename;
+	return false;
+#endif
+}
+
+// Creates or truncates a regular file for writing through io_uring
+bool UringIO::openOutput (const std::string & filename)
+{
+	closeOutput();
+
+#if defined(WILHELMCBC_HAVE_URING)
+	if (!available())
+		return false;
+
+	// Checked before opening, opening a FIFO for writing would wait for a reader
+	struct stat info;
+	if (stat(filename.c_str(), &info) == 0 && !S_ISREG(info.st_mode))
+		return false;
+
+	_outputFd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	return _outputFd >= 0;
+#else
+	(void)filename;
+	return false;
+#endif
+}
+
+void UringIO::closeInput ()
+{
+#if defined(WILHELMCBC_HAVE_URING)
+	if (_inputFd >= 0)
+		::close(_inputFd);
+#endif
+	_inputFd = -1;
+}
+
+void UringIO::closeOutput ()
+{
+#if defined(WILHELMCBC_HAVE_URING)
+	if (_outputFd >= 0)
+		::close(_outputFd);
+#endif
+	_outputFd = -1;
+}
+
+bool UringIO::inputOpen () const
+{
+	return _inputFd >= 0;
+}
+
+bool UringIO::outputOpen () const
+{
+	return _outputFd >= 0;
+}
+
+// Reads up to bytes at offset, for the odd block outside run()
+std::size_t UringIO::read (void * destination, std::size_t bytes, std::size_t offset)
+{
+	std::size_t done = 0;
+#if defined(WILHELMCBC_HAVE_URING)
+	while (done < bytes)
+	{
+		ssize_t got = pread(_inputFd, (char *)destination + done, bytes - done, (off_t)(offset + done));
+		if (got > 0)
+			done += (std::size_t)got;
+		else if (got == 0 || errno != EINTR)
+			break;
+	}
+#else
+	(void)destination;
+	(void)bytes;
+	(void)offset;
+#endif
+	return done;
+}
+
+// Writes bytes at offset, for the odd block outside run(). Returns false if not all of them were written.
+bool UringIO::write (const void * source, std::size_t bytes, std::size_t offset)
+{
+	std::size_t done = 0;
+#if defined(WILHELMCBC_HAVE_URING)
+	while (done < bytes)
+	{
+		ssize_t put = pwrite(_outputFd, (const char *)source + done, bytes - done, (off_t)(offset + done));
+		if (put > 0)
+			done += (std::size_t)put;
+		else if (put == 0 || errno != EINTR)
+			break;
+	}
+#else
+	(void)source;
+	(void)offset;
+#endif
+	return done == bytes;
+}
+
+// Runs read and process over consecutive slots until read reports the last one, and writes every processed slot.
+// Slot i is read into readBuffers[i] at readOffset and written from writeBuffers[i] at writeOffset, both advanced as it goes.
+// The two buffer lists may be the same. Returns false, having done nothing, if io_uring could not be set up.
+bool UringIO::run (const std::vector<unsigned char *> & readBuffers, const std::vector<unsigned char *> & writeBuffers, std::size_t bufferBytes,
+				   std::size_t & readOffset, std::size_t & writeOffset, const ReadStage & read, const ProcessStage & process)
+{
+#if !defined(WILHELMCBC_HAVE_URING)
+	(void)readBuffers;
+	(void)writeBuffers;
+	(void)bufferBytes;
+	(void)readOffset;
+	(void)writeOffset;
+	(void)read;
+	(void)process;
+	return false;
+#else
+	const std::size_t slots = readBuffers.size();
+	if (slots == 0 || writeBuffers.size() != slots || _inputFd < 0 || _outputFd < 0)
+		return false;
+
+	Ring ring;
+	if (!ring.open((unsigned int)slots))
+		return false;
+
+	// Registered (fixed) buffers save the kernel mapping them on every transfer. Memory lock limits may refuse them.
+	std::vector<iovec> buffers (2*slots);
+	for (std::size_t slot = 0; slot < slots; slot++)
+	{
+		buffers[slot].iov_base = readBuffers[slot];
+		buffers[slot].iov_len = bufferBytes;
+		buffers[slots + slot].iov_base = writeBuffers[slot];
+		buffers[slots + slot].iov_len = bufferBytes;
+	}
+	const bool fixed = syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, &buffers[0], (unsigned int)buffers.size()) == 0;
+
+	// What each slot is doing. A slot has at most one transfer in flight.
+	enum State {FREE, READING, READ, WRITING};
+	struct Transfer {
+		State			state;
+		std::size_t		sequence;	// Position in file order
+		unsigned char *	data;
+		std::size_t		remaining;
+		std::size_t		offset;
+	};
+	std::vector<Transfer> transfers (slots);
+	for (std::size_t slot = 0; slot < slots; slot++)
+		transfers[slot].state = FREE;
+
+	std::size_t inFlight = 0;
+	const char * error = NULL;
+
+	// Queues what is left of a slot's transfer. Nothing left moves it straight on.
+	auto queue = [&] (std::size_t slot)
+	{
+		Transfer & t = transfers[slot];
+		bool reading = (t.state == READING);
+		if (t.remaining == 0)
+		{
+			t.state = reading ? READ : FREE;
+			return;
+		}
+
+		io_uring_sqe * entry = ring.nextEntry();
+		entry->opcode = fixed ? (reading ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED) : (reading ? IORING_OP_READ : IORING_OP_WRITE);
+		entry->fd = reading ? _inputFd : _outputFd;
+		entry->off = t.offset;
+		entry->addr = (unsigned long)t.data;
+		entry->len = (unsigned int)std::min<std::size_t>(t.remaining, 1u << 30);
+		entry->buf_index = (unsigned short)(reading ? slot : slots + slot);
+		entry->user_data = slot;
+		inFlight++;
+	};
+
+	// Takes every posted completion, requeueing short transfers
+	auto reap = [&] ()
+	{
+		unsigned int head = *ring.cqHead;
+		unsigned int tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			const io_uring_cqe & done = ring.cqes[head & *ring.cqMask];
+			std::size_t slot = (std::size_t)done.user_data;
+			Transfer & t = transfers[slot];
+			inFlight--;
+
+			if (done.res <= 0)
+			{
+				if (!error)
+					error = (t.state == READING) ? "COULD NOT READ INPUT FILE" : "COULD NOT WRITE OUTPUT FILE";
+				continue;
+			}
+
+			t.data += done.res;
+			t.offset += (std::size_t)done.res;
+			t.remaining -= (std::size_t)done.res;
+			queue(slot);
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+	};
+
+	std::size_t nextRead = 0;
+	std::size_t nextProcess = 0;
+	std::size_t lastSequence = 0;
+	bool allRead = false;
+	bool allProcessed = false;
+
+	try
+	{
+		while (!allProcessed || inFlight > 0)
+		{
+			// Read ahead into every free slot
+			for (std::size_t slot = 0; slot < slots && !allRead; slot++)
+			{
+				if (transfers[slot].state != FREE)
+					continue;
+
+				std::size_t bytes = 0;
+				bool last = read(slot, bytes);
+				Transfer t = {READING, nextRead++, readBuffers[slot], bytes, readOffset};
+				transfers[slot] = t;
+				readOffset += bytes;
+				queue(slot);
+
+				if (last)
+				{
+					allRead = true;
+					lastSequence = t.sequence;
+				}
+			}
+
+			// Process the next slot in file order once its read is in, and write it behind
+			bool processed = false;
+			for (std::size_t slot = 0; slot < slots && !allProcessed; slot++)
+			{
+				if (transfers[slot].state != READ || transfers[slot].sequence != nextProcess)
+					continue;
+
+				std::size_t bytes = process(slot);
+				Transfer t = {WRITING, nextProcess++, writeBuffers[slot], bytes, writeOffset};
+				transfers[slot] = t;
+				writeOffset += bytes;
+				queue(slot);
+
+				allProcessed = allRead && t.sequence == lastSequence;
+				processed = true;
+				break;
+			}
+
+			// Only wait when there is nothing to process
+			ring.enter((processed || inFlight == 0) ? 0 : 1);
+			reap();
+
+			if (error)
+				throw std::runtime_error (error);
+		}
+	}
+	catch (...)
+	{
+		// The kernel may still be using the buffers
+		while (inFlight > 0)
+		{
+			ring.enter(1);
+			reap();
+		}
+		throw;
+	}
+
+	return true;
+#endif
+}
+
+// Whether this kernel lets us set up io_uring at all. Checked once.
+bool UringIO::available ()
+{
+#if defined(WILHELMCBC_HAVE_URING)
+	static const bool supported = Ring().open(1);
+	return supported;
+#else
+	return false;
+#endif
+}
+
+// Constructors
+
+UringIO::UringIO ()
+{
+	_inputFd = -1;
+	_outputFd = -1;
+}
+
+UringIO::~UringIO ()
+{
+	closeInput();
+	closeOutput();
+}
@@ -0,0 +1,73 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for UringIO class
+
+	Linux io_uring backend for regular input and output files, used through raw system calls (no liburing).
+	run() keeps every slot buffer busy from a single thread: reads are submitted ahead into free slots,
+	slots are processed in file order as their reads complete, and each one's write is submitted behind
+	while the next one is processed. Slot buffers are registered with the kernel for the duration of run().
+	Short transfers are resubmitted for the remainder.
+
+	Opening fails (returns false) when io_uring is missing, blocked, or the file is not a regular file,
+	so callers can fall back to streams. run() likewise returns false, before any IO, if no ring can be set up.
+
+	Usage:
+	********************************
+	UringIO io;
+	io.openInput (input);
+	io.openOutput (output);
+	io.run (readBuffers, writeBuffers, bufferBytes, readOffset, writeOffset, read, process);
+	********************************
+*/
+
+#ifndef __WilhelmCBC__UringIO__
+#define __WilhelmCBC__UringIO__
+
+#include <string>		// std::string
+#include <vector>		// std::vector
+#include <cstddef>		// std::size_t
+#include <functional>	// std::function
+
+class UringIO {
+public:
+// Types
+	typedef std::function<bool (std::size_t slot, std::size_t & bytes)> ReadStage;	// Sets the bytes to read into slot next, returns true for the last one
+	typedef std::function<std::size_t (std::size_t slot)> ProcessStage;				// Processes a read slot, returns the bytes to write from it
+
+// Public Methods
+	bool openInput (const std::string & filename);
+	bool openOutput (const std::string & filename);
+	void closeInput ();
+	void closeOutput ();
+	bool inputOpen () const;
+	bool outputOpen () const;
+
+	std::size_t read (void * destination, std::size_t bytes, std::size_t offset);	// Blocking, returns the bytes read
+	bool		write (const void * source, std::size_t bytes, std::size_t offset);	// Blocking
+
+	bool run (const std::vector<unsigned char *> & readBuffers, const std::vector<unsigned char *> & writeBuffers, std::size_t bufferBytes,
+			  std::size_t & readOffset, std::size_t & writeOffset, const ReadStage & read, const ProcessStage & process);
+
+	static bool available ();
+
+// Constructors
+	UringIO ();
+	~UringIO ();
+
+private:
+	UringIO (const UringIO &);
+	UringIO & operator= (const UringIO &);
+
+	struct Ring;
+
+// Private Data Members
+	int _inputFd;
+	int _outputFd;
+};
+
+#endif /* defined(__WilhelmCBC__UringIO__) */
@@ -0,0 +1,556 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Includes timing code written by Dr. Orion Sky Lawlor, lawlor@alaska.edu, in "NetRunlib.h".
+
+ Software is provided as is with no guarantees.
+
+
+ Microbenchmarks for the stages of WilhelmCBC, a separate program from the driver in main.cpp.
+
+ Each stage is timed on its own over a range of input sizes, with every lane engine (CipherCore) or
+ compression engine (SHA256) the CPU supports, and reported as MB/s and cycles/byte, on stdout and as JSON.
+
+ Stages:
+ ********************************
+ blockEnc, blockDec			One block at a time through the Feistel rounds, no chaining. The feistel function
+							is unrolled into the rounds, so this is what it costs.
+ blockEncLanes, blockDecLanes	Independent blocks, lanes() at a time
+ encCBC, decCBC				CipherCore::encryptCluster and decryptCluster, what WilhelmCBC's encCBC and decCBC run
+ encXEX, decXEX				CipherCore::encryptClusterXEX and decryptClusterXEX
+ SHA256::add				One running hash over every call
+ SHA256::finish				A whole message per call, add then finish, so small sizes show the padding block
+ SHA256::addMany			HASH_AHEAD_CLUSTERS messages per call, with each lane engine
+ encrypt, decrypt			The file loop: setInput, setOutput and encrypt() or decrypt() on a file of that size,
+							with each IO backend and cipher mode
+ ********************************
+
+ MB is 2^20 bytes, as in timePrint. Cycles are read from the time stamp counter, which counts at the nominal
+ clock rate rather than the core's, and are left out where there is no counter.
+
+ Build from this directory, with every source but main.cpp:
+	g++ -std=c++11 -O2 -pthread -o WilhelmBench $(ls *.cpp | grep -v main.cpp)
+
+ Usage:
+ ********************************
+ WilhelmBench [--sizes 64,4096,1048576] [--time seconds] [--threads n] [--stage name] [--dir directory] [--json file]
+ ********************************
+ */
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+#include "WilhelmCBC.h"
+#include "NetRunlib.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+static bool haveCycleCounter () { return true; }
+static uint64_t cycleCounter () { return __rdtsc(); }
+#else
+static bool haveCycleCounter () { return false; }
+static uint64_t cycleCounter () { return 0; }
+#endif
+
+typedef CipherCore::Block   Block;
+typedef CipherCore::LRSide  LRSide;
+
+// One stage timed at one size
+struct Result {
+    std::string stage;
+    std::string engine;
+    std::size_t size;
+    std::size_t calls;
+    double      seconds;
+    double      cycles;
+};
+
+// Options
+struct BenchOptions {
+    std::vector<std::size_t> sizes;
+    double      minSeconds;
+    unsigned int threads;
+    std::string stage;
+    std::string directory;
+    std::string jsonPath;
+    std::ostream * table;   // Text results, stderr when the JSON goes to stdout
+};
+
+// Engines tried, by the names setEngine knows. Ones missing from the build or the CPU are skipped.
+const char * const CIPHER_ENGINES[]      = {"avx512", "aes-ni", "scalar"};
+const char * const SHA256_ENGINES[]      = {"sha-ni", "scalar"};
+const char * const SHA256_LANE_ENGINES[] = {"avx512", "avx2", "4-lane", "none"};
+
+// Bytes of work between clock reads, so small sizes are not timing the clock
+const std::size_t BATCH_BYTES = 64*1024;
+
+// Function Prototypes
+int  benchMain (int argc, const char * argv[]);
+void usage ();
+bool parseSizes (const std::string & text, std::vector<std::size_t> & sizes);
+bool wanted (const BenchOptions & options, const std::string & stage);
+void benchCipher (const BenchOptions & options, std::vector<Result> & results);
+void benchHash (const BenchOptions & options, std::vector<Result> & results);
+void benchFiles (const BenchOptions & options, std::vector<Result> & results);
+void printResult (const Result & result, std::ostream & out);
+void writeJSON (const BenchOptions & options, const std::vector<Result> & results, std::ostream & out);
+
+// Data no optimizer can prove unused
+volatile unsigned char benchSink;
+
+
+template <typename Stage>
+void measure (const BenchOptions & options, const std::string & stage, const std::string & engine, std::size_t size,
+              Stage run, std::vector<Result> & results)
+{
+    /*
+     Runs run() once to warm up, then in batches of at least BATCH_BYTES until options.minSeconds have passed,
+     and adds the result (printed to the table as well). run() works on size bytes per call.
+     */
+
+    if (!wanted(options, stage))
+        return;
+
+    run();
+
+    std::size_t batch = (size < BATCH_BYTES) ? BATCH_BYTES/size : 1;
+    std::size_t calls = 0;
+    double t1 = time_in_seconds();
+    uint64_t c1 = cycleCounter();
+    double t2;
+    do
+    {
+        for (std::size_t i = 0; i < batch; i++)
+            run();
+        calls += batch;
+        t2 = time_in_seconds();
+    } while (t2 - t1 < options.minSeconds);
+    uint64_t c2 = cycleCounter();
+
+    Result result;
+    result.stage = stage;
+    result.engine = engine;
+    result.size = size;
+    result.calls = calls;
+    result.seconds = t2 - t1;
+    result.cycles = (double)(c2 - c1);
+    results.push_back(result);
+    printResult(result, *options.table);
+}
+
+
+int main(int argc, const char * argv[])
+{
+    try
+    {
+        return benchMain(argc, argv);
+    }
+    catch (std::runtime_error & e) {
+        std::cerr << e.what() << "\n";
+    }
+
+    return 1;
+}
+
+int benchMain (int argc, const char * argv[])
+{
+    /*
+     Parses the options, runs every stage wanted and writes the JSON.
+     Returns 0 on success, 2 for bad arguments. Throws if a stage fails.
+     */
+
+    BenchOptions options;
+    options.sizes.push_back(64);
+    options.sizes.push_back(4096);
+    options.sizes.push_back(64*1024);
+    options.sizes.push_back(1024*1024);
+    options.sizes.push_back(16*1024*1024);
+    options.minSeconds = 0.2;
+    options.threads = 1;
+    const char * tmp = getenv("TMPDIR");
+    options.directory = tmp ? tmp : "/tmp";
+
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        bool hasValue = (i+1 < argc);
+
+        if (arg == "--sizes" && hasValue)
+        {
+            if (!parseSizes(argv[++i], options.sizes))
+            {
+                std::cerr << "SIZES MUST BE NONZERO MULTIPLES OF " << BLOCK_BYTES << "\n";
+                return 2;
+            }
+        }
+        else if (arg == "--time" && hasValue)
+            options.minSeconds = strtod(argv[++i], NULL);
+        else if ((arg == "-j" || arg == "--threads") && hasValue)
+            options.threads = (unsigned int)strtoul(argv[++i], NULL, 10);
+        else if (arg == "--stage" && hasValue)
+            options.stage = argv[++i];
+        else if (arg == "--dir" && hasValue)
+            options.directory = argv[++i];
+        else if (arg == "--json" && hasValue)
+            options.jsonPath = argv[++i];
+        else if (arg == "-h" || arg == "--help")
+        {
+            usage();
+            return 0;
+        }
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    options.table = (options.jsonPath == "-") ? &std::cerr : &std::cout;
+    *options.table << std::left << std::setw(16) << "stage" << std::setw(10) << "engine" << std::right
+              << std::setw(10) << "bytes" << std::setw(12) << "MB/s" << std::setw(12) << "cycles/B" << "\n";
+
+    std::vector<Result> results;
+    benchCipher(options, results);
+    benchHash(options, results);
+    benchFiles(options, results);
+
+    if (options.jsonPath == "-")
+        writeJSON(options, results, std::cout);
+    else if (!options.jsonPath.empty())
+    {
+        std::ofstream json (options.jsonPath.c_str());
+        writeJSON(options, results, json);
+        if (!json)
+            throw std::runtime_error ("ERROR WRITING " + options.jsonPath);
+    }
+
+    return 0;
+}
+
+void usage ()
+{
+    std::cerr << "Usage: WilhelmBench [--sizes bytes,bytes,...] [--time seconds] [--threads n] [--stage name]\n"
+              << "                    [--dir directory] [--json file]\n"
+              << "  --sizes    Input sizes, multiples of " << BLOCK_BYTES << " (default 64,4096,65536,1048576,16777216)\n"
+              << "  --time     Least time spent on each stage and size (default 0.2)\n"
+              << "  --threads  Threads for the file loop (default 1)\n"
+              << "  --stage    Only stages starting with name, like encCBC or SHA256\n"
+              << "  --dir      Directory for the file loop's files (default $TMPDIR or /tmp)\n"
+              << "  --json     Write the results as JSON to file, - for stdout (the table then goes to stderr)\n";
+}
+
+bool parseSizes (const std::string & text, std::vector<std::size_t> & sizes)
+{
+    // Comma separated sizes in bytes, each a nonzero multiple of BLOCK_BYTES
+
+    std::vector<std::size_t> parsed;
+    std::stringstream list (text);
+    std::string item;
+    while (std::getline(list, item, ','))
+    {
+        char * end;
+        unsigned long long size = strtoull(item.c_str(), &end, 10);
+        if (item.empty() || *end != '\0' || item[0] == '-' || size == 0 || size % BLOCK_BYTES)
+            return false;
+        parsed.push_back((std::size_t)size);
+    }
+    if (parsed.empty())
+        return false;
+    sizes.swap(parsed);
+    return true;
+}
+
+bool wanted (const BenchOptions & options, const std::string & stage)
+{
+    return stage.compare(0, options.stage.size(), options.stage) == 0;
+}
+
+void benchCipher (const BenchOptions & options, std::vector<Result> & results)
+{
+    /*
+     The block cipher, its lane engines and both modes, in memory. Every cluster is CLUSTER_BYTES,
+     and the lane and cluster stages run once with each engine, which is put back after.
+     */
+
+    std::string defaultEngine = CipherCore::engineName();
+
+    Block baseKey;
+    for (unsigned int i = 0; i < BLOCK_BYTES; i++)
+        baseKey.data[i] = (unsigned char)(i*7 + 1);
+    CipherCore::KeySchedule schedule;
+    CipherCore::expandKey(baseKey, schedule);
+    Block iv = baseKey;
+
+    LRSide roundKeys[FEISTEL_ROUNDS];
+    CipherCore::roundKeys(schedule, 0, 0, roundKeys);
+
+    for (std::size_t s = 0; s < options.sizes.size(); s++)
+    {
+        std::size_t size = options.sizes[s];
+        std::size_t blockCount = size/BLOCK_BYTES;
+        std::vector<Block> data (blockCount);
+        for (std::size_t i = 0; i < size; i++)
+            data[i/BLOCK_BYTES].data[i%BLOCK_BYTES] = (unsigned char)i;
+
+        measure(options, "blockEnc", "scalar", size, [&] ()
+        {
+            for (std::size_t b = 0; b < blockCount; b++)
+                CipherCore::blockEnc(data[b], roundKeys);
+        }, results);
+        measure(options, "blockDec", "scalar", size, [&] ()
+        {
+            for (std::size_t b = 0; b < blockCount; b++)
+                CipherCore::blockDec(data[b], roundKeys);
+        }, results);
+
+        // Lane inputs, each block with its own blockKey as in XEX
+        std::vector<Block *> blocks (blockCount);
+        std::vector<LRSide> blockKeys (blockCount);
+        for (std::size_t b = 0; b < blockCount; b++)
+        {
+            blocks[b] = &data[b];
+            blockKeys[b] = CipherCore::blockKey(schedule, 0, b);
+        }
+
+        for (std::size_t e = 0; e < sizeof(CIPHER_ENGINES)/sizeof(CIPHER_ENGINES[0]); e++)
+        {
+            if (!CipherCore::setEngine(CIPHER_ENGINES[e]))
+                continue;
+            std::string engine = CIPHER_ENGINES[e];
+            std::size_t lanes = CipherCore::lanes();
+
+            measure(options, "blockEncLanes", engine, size, [&] ()
+            {
+                for (std::size_t b = 0; b < blockCount; b += lanes)
+                    CipherCore::blockEncLanes(&blocks[b], &blockKeys[b], std::min(lanes, blockCount-b));
+            }, results);
+            measure(options, "blockDecLanes", engine, size, [&] ()
+            {
+                for (std::size_t b = 0; b < blockCount; b += lanes)
+                    CipherCore::blockDecLanes(&blocks[b], &blockKeys[b], std::min(lanes, blockCount-b));
+            }, results);
+
+            // Clusters one after another, as encCBC and decCBC run them
+            Block chain;
+            measure(options, "encCBC", engine, size, [&] ()
+            {
+                chain = iv;
+                for (std::size_t offset = 0; offset < size; offset += CLUSTER_BYTES)
+                    CipherCore::encryptCluster(schedule, offset/CLUSTER_BYTES, &data[offset/BLOCK_BYTES], &data[offset/BLOCK_BYTES],
+                                               std::min<std::size_t>(CLUSTER_BYTES, size-offset), CLUSTER_BYTES, chain);
+            }, results);
+            measure(options, "decCBC", engine, size, [&] ()
+            {
+                chain = iv;
+                for (std::size_t offset = 0; offset < size; offset += CLUSTER_BYTES)
+                    CipherCore::decryptCluster(schedule, offset/CLUSTER_BYTES, &data[offset/BLOCK_BYTES], &data[offset/BLOCK_BYTES],
+                                               std::min<std::size_t>(CLUSTER_BYTES, size-offset), CLUSTER_BYTES, chain);
+            }, results);
+            measure(options, "encXEX", engine, size, [&] ()
+            {
+                for (std::size_t offset = 0; offset < size; offset += CLUSTER_BYTES)
+                    CipherCore::encryptClusterXEX(schedule, offset/CLUSTER_BYTES, iv, &data[offset/BLOCK_BYTES], &data[offset/BLOCK_BYTES],
+                                                  std::min<std::size_t>(CLUSTER_BYTES, size-offset), CLUSTER_BYTES);
+            }, results);
+            measure(options, "decXEX", engine, size, [&] ()
+            {
+                for (std::size_t offset = 0; offset < size; offset += CLUSTER_BYTES)
+                    CipherCore::decryptClusterXEX(schedule, offset/CLUSTER_BYTES, iv, &data[offset/BLOCK_BYTES], &data[offset/BLOCK_BYTES],
+                                                  std::min<std::size_t>(CLUSTER_BYTES, size-offset), CLUSTER_BYTES);
+            }, results);
+        }
+        CipherCore::setEngine(defaultEngine);
+
+        benchSink = data[0].data[0];
+    }
+}
+
+void benchHash (const BenchOptions & options, std::vector<Result> & results)
+{
+    /*
+     SHA256 with each compression engine, then addMany with each lane engine. Engines are put back after.
+     */
+
+    std::string defaultEngine = SHA256::engineName();
+    std::string defaultLaneEngine = SHA256::laneEngineName();
+
+    for (std::size_t s = 0; s < options.sizes.size(); s++)
+    {
+        std::size_t size = options.sizes[s];
+        std::vector<unsigned char> data (size*HASH_AHEAD_CLUSTERS);
+        for (std::size_t i = 0; i < data.size(); i++)
+            data[i] = (unsigned char)i;
+
+        for (std::size_t e = 0; e < sizeof(SHA256_ENGINES)/sizeof(SHA256_ENGINES[0]); e++)
+        {
+            if (!SHA256::setEngine(SHA256_ENGINES[e]))
+                continue;
+
+            SHA256 running;
+            measure(options, "SHA256::add", SHA256_ENGINES[e], size, [&] ()
+            {
+                running.add(&data[0], size);
+            }, results);
+            benchSink = running.finish().data[0];
+
+            measure(options, "SHA256::finish", SHA256_ENGINES[e], size, [&] ()
+            {
+                SHA256 message;
+                message.add(&data[0], size);
+                benchSink = message.finish().data[0];
+            }, results);
+        }
+        SHA256::setEngine(defaultEngine);
+
+        std::vector<const void *> messages (HASH_AHEAD_CLUSTERS);
+        for (std::size_t m = 0; m < HASH_AHEAD_CLUSTERS; m++)
+            messages[m] = &data[m*size];
+        std::vector<SHA256::digest> digests (HASH_AHEAD_CLUSTERS);
+
+        for (std::size_t e = 0; e < sizeof(SHA256_LANE_ENGINES)/sizeof(SHA256_LANE_ENGINES[0]); e++)
+        {
+            if (!SHA256::setLaneEngine(SHA256_LANE_ENGINES[e]))
+                continue;
+            measure(options, "SHA256::addMany", SHA256_LANE_ENGINES[e], size*HASH_AHEAD_CLUSTERS, [&] ()
+            {
+                SHA256::addMany(&messages[0], size, HASH_AHEAD_CLUSTERS, &digests[0]);
+            }, results);
+            benchSink = digests[0].data[0];
+        }
+        SHA256::setLaneEngine(defaultLaneEngine);
+    }
+}
+
+void benchFiles (const BenchOptions & options, std::vector<Result> & results)
+{
+    /*
+     The whole file loop through WilhelmCBC, with the default engines, for each IO backend and cipher mode.
+     The key is set once, outside the timing. The files are removed after.
+     Throws if a file cannot be written or does not decrypt.
+     */
+
+    if (!wanted(options, "encrypt") && !wanted(options, "decrypt"))
+        return;
+
+    const char * const backendNames[] = {"mapped", "uring", "stream"};
+    const WilhelmCBC::IOBackend backends[] = {WilhelmCBC::IO_MAPPED, WilhelmCBC::IO_URING, WilhelmCBC::IO_STREAM};
+    const char * const modeNames[] = {"cbc", "xex"};
+    const WilhelmCBC::CipherMode modes[] = {WilhelmCBC::MODE_CBC, WilhelmCBC::MODE_XEX};
+
+    std::string plainPath = options.directory + "/WilhelmBench.plain";
+    std::string cipherPath = options.directory + "/WilhelmBench.enc";
+    std::string decryptedPath = options.directory + "/WilhelmBench.dec";
+
+    WilhelmCBC cipherObj;
+    cipherObj.setKey("WilhelmBench");
+    cipherObj.setThreads(options.threads);
+
+    for (std::size_t s = 0; s < options.sizes.size(); s++)
+    {
+        std::size_t size = options.sizes[s];
+        {
+            std::vector<char> data (size);
+            for (std::size_t i = 0; i < size; i++)
+                data[i] = (char)(i*31);
+            std::ofstream plain (plainPath.c_str(), std::ios::binary | std::ios::trunc);
+            plain.write(&data[0], size);
+            if (!plain)
+                throw std::runtime_error ("ERROR WRITING " + plainPath);
+        }
+
+        for (std::size_t b = 0; b < sizeof(backends)/sizeof(backends[0]); b++)
+            for (std::size_t m = 0; m < sizeof(modes)/sizeof(modes[0]); m++)
+            {
+                cipherObj.setIOBackend(backends[b]);
+                cipherObj.setCipherMode(modes[m]);
+                std::string engine = std::string(backendNames[b]) + "/" + modeNames[m];
+
+                measure(options, "encrypt", engine, size, [&] ()
+                {
+                    cipherObj.setInput(plainPath);
+                    cipherObj.setOutput(cipherPath);
+                    cipherObj.encrypt();
+                }, results);
+
+                // Needs a file to decrypt even when only decrypt is wanted
+                if (!wanted(options, "encrypt"))
+                {
+                    cipherObj.setInput(plainPath);
+                    cipherObj.setOutput(cipherPath);
+                    cipherObj.encrypt();
+                }
+                measure(options, "decrypt", engine, size, [&] ()
+                {
+                    cipherObj.setInput(cipherPath);
+                    cipherObj.setOutput(decryptedPath);
+                    if (!cipherObj.decrypt())
+                        throw std::runtime_error ("BENCHMARK FILE FAILED TO DECRYPT");
+                }, results);
+            }
+    }
+
+    remove(plainPath.c_str());
+    remove(cipherPath.c_str());
+    remove(decryptedPath.c_str());
+}
+
+void printResult (const Result & result, std::ostream & out)
+{
+    double bytes = (double)result.size * result.calls;
+    // Numbers formatted on the side, so out keeps its format for the JSON
+    std::ostringstream speed, cycles;
+    speed << std::fixed << std::setprecision(1) << bytes/result.seconds/(1024*1024);
+    if (haveCycleCounter())
+        cycles << std::fixed << std::setprecision(2) << result.cycles/bytes;
+    else
+        cycles << "-";
+
+    out << std::left << std::setw(16) << result.stage << std::setw(10) << result.engine << std::right
+        << std::setw(10) << result.size << std::setw(12) << speed.str() << std::setw(12) << cycles.str() << std::endl;
+}
+
+void writeJSON (const BenchOptions & options, const std::vector<Result> & results, std::ostream & out)
+{
+    /*
+     One object: the settings, the default engines and one entry per result.
+     cycles_per_byte is null without a cycle counter. Names are all plain ASCII, so nothing is escaped.
+     */
+
+    out << std::defaultfloat << std::setprecision(6) << "{\n"
+        << "  \"min_seconds\": " << options.minSeconds << ",\n"
+        << "  \"threads\": " << options.threads << ",\n"
+        << "  \"cluster_bytes\": " << CLUSTER_BYTES << ",\n"
+        << "  \"cipher_engine\": \"" << CipherCore::engineName() << "\",\n"
+        << "  \"sha256_engine\": \"" << SHA256::engineName() << "\",\n"
+        << "  \"sha256_lane_engine\": \"" << SHA256::laneEngineName() << "\",\n"
+        << "  \"results\": [";
+
+    for (std::size_t i = 0; i < results.size(); i++)
+    {
+        const Result & result = results[i];
+        double bytes = (double)result.size * result.calls;
+
+        out << (i ? ",\n" : "\n")
+            << "    {\"stage\": \"" << result.stage << "\", \"engine\": \"" << result.engine << "\""
+            << ", \"size\": " << result.size << ", \"calls\": " << result.calls
+            << ", \"seconds\": " << result.seconds
+            << ", \"mb_per_second\": " << bytes/result.seconds/(1024*1024)
+            << ", \"cycles_per_byte\": ";
+        if (haveCycleCounter())
+            out << result.cycles/bytes;
+        else
+            out << "null";
+        out << "}";
+    }
+
+    out << "\n  ]\n}\n";
+}
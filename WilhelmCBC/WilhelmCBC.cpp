@@ -19,33 +19,111 @@
 #include "WilhelmCBC.h"
 
 #include <stdexcept>	// setInput may throw
+#include <algorithm>	// std::min
+#include <cstring>		// memcpy
 #include <iostream>		// Debugging
 #include <iomanip>		// Debugging
 
 extern SHA256::digest SHA256_digest (const std::string &src);
 
+/* Identifies the header block at the start of an encrypted file */
+static const unsigned char HEADER_MAGIC[8] = {'W', 'i', 'l', 'h', 'C', 'B', 'C', '\0'};
+
+/* Identifies the index blocks either side of the index entries in the footer */
+static const unsigned char INDEX_MAGIC[8] = {'W', 'i', 'l', 'h', 'I', 'D', 'X', '\0'};
+
+/* Little endian 64 bit fields of the footer index */
+static uint64_t readLE64 (const unsigned char * bytes)
+{
+	uint64_t value = 0;
+	for (unsigned int i = 0; i < 8; i++)
+		value |= (uint64_t)bytes[i] << (8*i);
+	return value;
+}
+
+static void writeLE64 (unsigned char * bytes, uint64_t value)
+{
+	for (unsigned int i = 0; i < 8; i++)
+		bytes[i] = (unsigned char)(value >> (8*i));
+}
+
 // Public Methods
 void WilhelmCBC::setInput (std::string filename)
 {
+	// Starts a new file. The key stays set, so one object can work through many files.
+    _indexToStream = 0;
+    _blockNum = 0;
+    _clusterNum = 0;
+    _lastCluster = false;
+    _currentBlockSet.clear();
+    _memoryIO = false;
+
 	// Open data file
+    _ifile.close();
+    _ifile.clear();
     _ifile.open (filename.c_str(), std::ios::in | std::ios::binary);
     if (!_ifile.is_open())
         throw (std::runtime_error("Could not open input file. Check that directory path is valid."));
 
 	// Find length of data file
     _ifile.seekg(0, std::ios::end);
-    _inputSize = _ifile.tellg();
+    std::streampos end = _ifile.tellg();
     _ifile.clear();
     _ifile.seekg(0, std::ios::beg);
+
+    // Pipes can't seek. Their length is found by reading ahead, see findInputEnd()
+    _streamingInput = (end == std::streampos(-1));
+    _lookahead.clear();
+    _lookaheadStart = 0;
+    if (_streamingInput)
+    {
+        _ifile.clear();
+        _inputOffset = 0;
+        _inputSize = STREAM_SIZE_UNKNOWN;
+        _inputMap.close();
+        _uring.closeInput();
+        return;
+    }
+    _inputSize = (std::size_t)end;
+
+    // Regular files are mapped (or read through io_uring, see setIOBackend) instead of read through the stream.
+    // Pipes and the like stay on the stream.
+    _inputOffset = 0;
+    _inputMap.close();
+    _uring.closeInput();
+    if (_ioBackend == IO_URING && _uring.openInput(filename))
+        _ifile.close();
+    else if (_ioBackend == IO_MAPPED && _inputMap.openRead(filename) && _inputMap.size() == _inputSize)
+        _ifile.close();
+    else
+        _inputMap.close();
 }
 
 void WilhelmCBC::setOutput (std::string filename)
 {
 	// Open output file
+    _memoryIO = false;
+    _ofile.close();
+    _ofile.clear();
+    _outputMap.close();
     _ofile.open (filename.c_str(), std::ios::out | std::ios::binary);
     if (!_ofile.is_open())
         throw (std::runtime_error("Could not open output file. Check that directory path is valid."));
 
+    // Mapped once the output size is known, see mapOutput()
+    _outputName = filename;
+
+    // Regular files are written through io_uring instead, if asked for
+    _uring.closeOutput();
+    if (_ioBackend == IO_URING && _uring.openOutput(filename))
+        _ofile.close();
+}
+
+// How the files of later setInput and setOutput calls are read and written. IO_MAPPED by default.
+// IO_URING falls back to the streams where io_uring is not available, or for anything but regular files.
+void WilhelmCBC::setIOBackend (IOBackend backend)
+{
+	_ioBackend = backend;
 }
 
 void WilhelmCBC::setKey (std::string password)
@@ -61,6 +139,43 @@ void WilhelmCBC::setKey (std::string password)
 	// Hash key block 5 more times
 	for (int i = 0; i < HASHING_REPEATS; i++)
 		Hash_SHA256_Block(_baseKey);
+
+	// Derive the round key tables once per key
+	CipherCore::expandKey(_baseKey, _keySchedule);
+}
+
+// Cluster size for encrypt(), recorded in the file header. decrypt() always uses the size from the file.
+void WilhelmCBC::setClusterSize (std::size_t clusterBytes)
+{
+	if (!validClusterSize(clusterBytes))
+		throw std::runtime_error ("CLUSTER SIZE MUST BE A MULTIPLE OF 4 KiB, UP TO 16 MiB");
+
+	_clusterBytes = clusterBytes;
+}
+
+// Mode of operation for encrypt(), recorded in the file header. MODE_CBC by default.
+// MODE_XEX files encrypt across setThreads() threads like decryption, but are not readable before FILE_VERSION 2.
+void WilhelmCBC::setCipherMode (CipherMode mode)
+{
+	_cipherMode = mode;
+}
+
+// Integrity hash for encrypt(), recorded in the file header. FLAT is the original hash of cluster hashes.
+void WilhelmCBC::setIntegrityMode (HashTree::Mode mode)
+{
+	_integrityMode = mode;
+}
+
+// Whether encrypt() ends files in a footer index of per cluster offsets and digests. Off by default.
+void WilhelmCBC::setIndex (bool index)
+{
+	_writeIndex = index;
+}
+
+// Number of threads decrypt() spreads clusters over, 1 for fully serial decryption
+void WilhelmCBC::setThreads (unsigned int threads)
+{
+	_threads = threads ? threads : 1;
 }
 
 std::size_t WilhelmCBC::getSize()
@@ -68,132 +183,213 @@ std::size_t WilhelmCBC::getSize()
 	return _inputSize;
 }
 
+// Encrypts inputBytes of memory into output, in the same format as encrypt() writes to a file.
+// output needs encryptedSize(inputBytes) bytes. Returns the bytes written.
+std::size_t WilhelmCBC::encryptBuffer (const void * input, std::size_t inputBytes, void * output, std::size_t outputBytes)
+{
+	struct iovec inputRange = {const_cast<void *>(input), inputBytes};
+	struct iovec outputRange = {output, outputBytes};
+	return encryptBuffer(&inputRange, 1, &outputRange, 1);
+}
+
+// Encrypts the ranges of input, taken in order as one plaintext, scattering the result over the ranges of output.
+// Throws if any input range overlaps an output range.
+std::size_t WilhelmCBC::encryptBuffer (const struct iovec * input, std::size_t inputCount, const struct iovec * output, std::size_t outputCount)
+{
+	setMemory(input, inputCount, output, outputCount);
+	if (_inputMemory.overlaps(_outputMemory))
+		throw std::runtime_error ("INPUT AND OUTPUT BUFFERS OVERLAP");
+	encrypt();
+	return _outputOffset;
+}
+
+// Decrypts inputBytes of memory, as written by encrypt() or encryptBuffer(), into output.
+// An output as large as the input is always enough, and output may be input itself. Sets plainBytes, and returns whether the HMAC matched.
+bool WilhelmCBC::decryptBuffer (const void * input, std::size_t inputBytes, void * output, std::size_t outputBytes, std::size_t & plainBytes)
+{
+	struct iovec inputRange = {const_cast<void *>(input), inputBytes};
+	struct iovec outputRange = {output, outputBytes};
+	return decryptBuffer(&inputRange, 1, &outputRange, 1, plainBytes);
+}
+
+// Decrypts the ranges of input, taken in order as one encrypted file, scattering the plaintext over the ranges of output
+bool WilhelmCBC::decryptBuffer (const struct iovec * input, std::size_t inputCount, const struct iovec * output, std::size_t outputCount,
+								std::size_t & plainBytes)
+{
+	setMemory(input, inputCount, output, outputCount);
+	bool matched = decrypt();
+	plainBytes = _outputOffset;
+	return matched;
+}
+
+// Size encrypt() makes of plainBytes: header, IV, data padded to whole blocks, padding block and hash,
+//	and with setIndex the footer index over clusters of clusterBytes
+std::size_t WilhelmCBC::encryptedSize (std::size_t plainBytes, bool index, std::size_t clusterBytes)
+{
+	std::size_t size = (plainBytes+BLOCK_BYTES-1)/BLOCK_BYTES*BLOCK_BYTES + 4*BLOCK_BYTES;
+	if (index)
+		size += indexFooterBytes(std::max<std::size_t>((plainBytes+clusterBytes-1)/clusterBytes, 1));
+	return size;
+}
+
 void WilhelmCBC::encrypt ()
 {
-	// Temp storage for each clusters individual hashes
-	std::vector <Block> clusterHashes;
+	beginEncrypt();
 
-	if (!_ifile.is_open())
-        throw std::runtime_error ("NO INPUT FILE HAS BEEN OPENED");
-	if (!_ofile.is_open())
-        throw std::runtime_error ("NO OUTPUT FILE HAS BEEN SET");
-	if (_baseKey == Block())
-        throw std::runtime_error ("NO PASSWORD HAS BEEN SET");
+	// XEX clusters do not chain, so all but the last are encrypted out of order like decrypt() does
+	if (_fileMode == MODE_XEX)
+		cryptClustersParallel(true);
 
-	// Create IV
-	_lastBlockPrevCluster = IVGenerator();
-	
-	// Write IV
-	_ofile.write ((char*)&_lastBlockPrevCluster.data[0], BLOCK_BYTES);
-	
-	while (!_ifile.fail())
+	// Streams overlap reading, encrypting and writing. Memory is copied on this thread.
+	if (!_memoryIO && !_outputMap.isOpen() && !encryptUring())
+		encryptPipelined();
+
+	while (!_lastCluster)
 	{
-		// Read in a cluster
-		if (_indexToStream + CLUSTER_BYTES < _inputSize)
+		// Full clusters go straight from the input mapping to the output mapping, hashed several at a time
+		std::size_t mappedBytes;
+		if (inputMapping(mappedBytes) && outputMapping(mappedBytes) && _indexToStream + _clusterBytes < _inputSize)
 		{
-			// Reads in the next section
-			_currentBlockSet.resize(CLUSTER_BYTES/BLOCK_BYTES);
-			_ifile.read((char*)&_currentBlockSet[0],CLUSTER_BYTES);
-
-			// Update pos in stream.
-			_indexToStream += CLUSTER_BYTES;
+			std::size_t fullClusters = (_inputSize-_indexToStream-1)/_clusterBytes;
+			encryptMappedClusters(std::min<std::size_t>(fullClusters, HASH_AHEAD_CLUSTERS));
+			continue;
 		}
-		else // Last cluster, <= CLUSTER_BYTES
-		{
-			// Reads in rest of file, tries to read 1 off end, setting the fail bit and prevent loop from continuing
-			std::size_t tempBlockNum = (_inputSize%CLUSTER_BYTES)/BLOCK_BYTES;
-			if (_inputSize%BLOCK_BYTES)
-				tempBlockNum++;
-			_currentBlockSet.resize(tempBlockNum);
-			_ifile.read((char*)&_currentBlockSet[0],_inputSize-_indexToStream+1);
 
-			// Update pos in stream.
-			_indexToStream = _inputSize;
-		}
+		readPlainCluster();
 
 		// Hash cluster before encrypting
-		clusterHashes.push_back(Hash_SHA256_Current_Cluster());
+		addClusterHash(Hash_SHA256_Current_Cluster());
 
 		// Encrypts cluster
 		encCBC();
 
-		// Write out to file, all last cluster cases include +BLOCK_BYTES to account for padding block
-		// Not last cluster
-		if (_indexToStream < _inputSize)
-			_ofile.write((char*)&_currentBlockSet[0], _currentBlockSet.size()*BLOCK_BYTES);
-		// Last cluster and Last Block not a multiple of BLOCK_BYTES
-		else if (_inputSize%CLUSTER_BYTES && _inputSize%BLOCK_BYTES)
-			_ofile.write((char*)&_currentBlockSet[0], (_inputSize%CLUSTER_BYTES)-(_inputSize%BLOCK_BYTES)+BLOCK_BYTES+BLOCK_BYTES);
-		// Last cluster and Last Block is a multiple of BLOCK_BYTES
-		else if (_inputSize%CLUSTER_BYTES)
-			_ofile.write((char*)&_currentBlockSet[0], (_inputSize%CLUSTER_BYTES) + BLOCK_BYTES);
-		// Last cluster and cluster is a CLUSTER_BYTES in size.
-		else
-			_ofile.write((char*)&_currentBlockSet[0], CLUSTER_BYTES + BLOCK_BYTES);
-
-		// Not strictly necessary, but good for what happens when this loop ends, and doesn't change capacity.
-		_currentBlockSet.clear();
+		writeCipherCluster();
 	}
 
-	// Assign clusterHashes to _currentBlockCluster
+	finishEncrypt();
+}
 
-	_currentBlockSet = clusterHashes;
-	
-	// Encrypt clusterHashers and write it out to file
-	Block hashesTemp = Hash_SHA256_Current_Cluster();
+// Encrypts many independent files, keeping up to ENCRYPT_LANES of them open and advancing them a cluster at a time in lockstep.
+// Full clusters of all open files are encrypted together by encCBCInterleaved, so their CBC chains share one Feistel kernel.
+void WilhelmCBC::encryptBatch (const std::vector<EncryptJob> & jobs, std::size_t clusterBytes)
+{
+	std::unique_ptr<WilhelmCBC> lanes[ENCRYPT_LANES];
+	WilhelmCBC * fullClusterLanes[ENCRYPT_LANES];
+	std::size_t nextJob = 0;
+	std::size_t openLanes = 0;
 
-	_ofile.write((char*)&hashesTemp.data[0], BLOCK_BYTES);
+	while (nextJob < jobs.size() || openLanes > 0)
+	{
+		// Refill lanes freed by finished files
+		for (std::size_t lane = 0; lane < ENCRYPT_LANES && nextJob < jobs.size(); lane++)
+		{
+			if (lanes[lane])
+				continue;
+
+			const EncryptJob & job = jobs[nextJob++];
+			lanes[lane].reset(new WilhelmCBC);
+			lanes[lane]->setClusterSize(clusterBytes);
+			lanes[lane]->setInput(job.input);
+			lanes[lane]->setKey(job.password);
+			lanes[lane]->setOutput(job.output);
+			lanes[lane]->beginEncrypt();
+			openLanes++;
+		}
 
-	// Cleanup
-	_indexToStream = 0;
-	_currentBlock = NULL;
-	_currentL = NULL;
-	_currentR = NULL;
-	_currentBlockSet.clear();
-	_blockNum = 0;
-	_roundNum = 0;
-	_clusterNum = 0;
+		// Read the next cluster of every open file, set aside the full (non final) ones
+		std::size_t fullClusterCount = 0;
+		for (std::size_t lane = 0; lane < ENCRYPT_LANES; lane++)
+		{
+			if (!lanes[lane])
+				continue;
+
+			lanes[lane]->readPlainCluster();
+
+			if (lanes[lane]->_indexToStream < lanes[lane]->_inputSize)
+				fullClusterLanes[fullClusterCount++] = lanes[lane].get();
+			else
+			{
+				// Last cluster, with padding
+				lanes[lane]->addClusterHash(lanes[lane]->Hash_SHA256_Current_Cluster());
+				lanes[lane]->encCBC();
+			}
+		}
+
+		// Full clusters are all clusterBytes long, so they hash side by side
+		const void * fullClusters[ENCRYPT_LANES];
+		Block fullClusterHashes[ENCRYPT_LANES];
+		for (std::size_t i = 0; i < fullClusterCount; i++)
+			fullClusters[i] = &fullClusterLanes[i]->_currentBlockSet[0];
+		Hash_SHA256_Many(fullClusters, clusterBytes, fullClusterCount, fullClusterHashes);
+		for (std::size_t i = 0; i < fullClusterCount; i++)
+			fullClusterLanes[i]->addClusterHash(fullClusterHashes[i]);
+
+		encCBCInterleaved(fullClusterLanes, fullClusterCount);
+
+		// Write out, and close the files that are done
+		for (std::size_t lane = 0; lane < ENCRYPT_LANES; lane++)
+		{
+			if (!lanes[lane])
+				continue;
+
+			lanes[lane]->writeCipherCluster();
+
+			if (lanes[lane]->_lastCluster)
+			{
+				lanes[lane]->finishEncrypt();
+				lanes[lane].reset();
+				openLanes--;
+			}
+		}
+	}
 }
 
 bool WilhelmCBC::decrypt ()
 {
-	// Temp storage for each clusters individual hashes of unencrypted data
-	std::vector <Block> clusterHashes;
 	Block OrigHashChecksum = Block();
 
-	if (!_ifile.is_open())
-        throw std::runtime_error ("NO INPUT FILE HAS BEEN OPENED");
-	if (_inputSize == 0)
-		throw std::runtime_error ("INPUT FILE IS EMPTY");
-	if (_inputSize % BLOCK_BYTES) // All encrypted files are a multiple of BLOCK_BYTES long
-		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
-	if (!_ofile.is_open())
-        throw std::runtime_error ("NO OUTPUT FILE HAS BEEN SET");
-	if (_baseKey == Block())
-        throw std::runtime_error ("NO PASSWORD HAS BEEN SET");
+	// Decrypted output is never longer than the input
+	beginDecrypt(_inputSize);
 
-	// Read IV
-	_ifile.read((char*)&_lastBlockPrevCluster.data[0], BLOCK_BYTES);
-	_inputSize -= BLOCK_BYTES; // Less file size for IV
+	// Everything up to the last cluster can be decrypted out of order, and mapped files need no staging copies
+	cryptClustersParallel(false);
 
-	while (!_ifile.fail())
+	while (!_lastCluster)
 	{
-		// Read a cluster
-		if (_indexToStream + CLUSTER_BYTES < _inputSize)
+		std::size_t clusterStart = _indexToStream;
+
+		// Streaming input: look past this cluster for the end. The padding block and hash always follow the last cluster,
+		//	and in indexed files the index block follows them.
+		if (_streamingInput && !_inputIndexed)
+			findInputEnd(_indexToStream, _clusterBytes + 2*BLOCK_BYTES, _inputSize);
+		else if (_streamingInput)
+		{
+			bool ended = findInputEnd(_indexToStream, _clusterBytes + 3*BLOCK_BYTES, _inputSize);
+			if (!findIndexStart() && ended)
+				throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+		}
+
+		// Read a cluster, unless all that follows it is the padding block and hash
+		if (_indexToStream + _clusterBytes + 2*BLOCK_BYTES < _inputSize)
 		{
 			// Reads in next section
-			_currentBlockSet.resize(CLUSTER_BYTES/BLOCK_BYTES);
-			_ifile.read((char*)&_currentBlockSet[0],CLUSTER_BYTES);
+			_currentBlockSet.resize(_clusterBytes/BLOCK_BYTES);
+			readInput(&_currentBlockSet[0],_clusterBytes);
 
 			// Update pos in stream
-			_indexToStream += CLUSTER_BYTES;
+			_indexToStream += _clusterBytes;
 		}
-		// Last cluster, <= CLUSTER_BYTES
+		// Last cluster, <= _clusterBytes plus padding block and hash
 		else
 		{
-			// Reads in rest of file, tries to read 1 off end, setting the fail bit and prevent loop from continuing
-			_currentBlockSet.resize((_inputSize%CLUSTER_BYTES)/BLOCK_BYTES);
-			_ifile.read((char*)&_currentBlockSet[0],_inputSize-_indexToStream+1);
+			// At least one block, the padding block and the hash
+			if (_inputSize < _indexToStream + 3*BLOCK_BYTES || (_inputSize-_indexToStream) % BLOCK_BYTES)
+				throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+
+			// Reads in rest of file, and ends the loop
+			_currentBlockSet.resize((_inputSize-_indexToStream)/BLOCK_BYTES);
+			readInput(&_currentBlockSet[0],std::min<std::size_t>(_inputSize-_indexToStream, _currentBlockSet.size()*BLOCK_BYTES));
+			_lastCluster = true;
 			
 			// Update pos in stream.
 			_indexToStream = _inputSize;
@@ -206,288 +402,1249 @@ bool WilhelmCBC::decrypt ()
 		if (_indexToStream >= _inputSize)
 			_currentBlockSet.resize(_currentBlockSet.size()-1);
 
-		clusterHashes.push_back(Hash_SHA256_Current_Cluster());
+		addClusterHash(Hash_SHA256_Current_Cluster());
 
 		// Write out to file
 		if (_indexToStream < _inputSize)
-			_ofile.write((char*)&_currentBlockSet[0], CLUSTER_BYTES);
+			writeOutput(&_currentBlockSet[0], _clusterBytes);
 		else 
 		{
 			// Write out to file remaining data. Padding removed from _inputSize scope in final decCBC
-			_ofile.write((char*)&_currentBlockSet[0], (_inputSize%CLUSTER_BYTES));
+			writeOutput(&_currentBlockSet[0], _inputSize-clusterStart);
 		}
-
-		_currentBlockSet.clear();
 	}
 	
-	// Assign Hashes
-	_currentBlockSet = clusterHashes;
-	Block tempVal = Hash_SHA256_Current_Cluster();
+	// Root of the cluster hashes
+	Block tempVal = finishClusterHashes();
+
+	closeOutput();
 
 	// Cleanup
 	_indexToStream = 0;
-	_currentBlock = NULL;
-	_currentL = NULL;
-	_currentR = NULL;
 	_currentBlockSet.clear();
 	_blockNum = 0;
-	_roundNum = 0;
 	_clusterNum = 0;
 
 	return (OrigHashChecksum == tempVal);
 }
 
+// Decrypts only plaintext bytes offset to offset+length of the input into the output, cut short at the end of the plaintext.
+// Clusters are independent given the ciphertext block before them, so the input is seeked straight to the clusters
+//	holding the range, and nothing else is read. Returns the bytes written.
+// The hash of the whole file is not checked, it needs every cluster. Indexed files have each cluster checked against
+//	its index entry instead, before any of it is written, and throw on a mismatch. Throws if the input cannot seek.
+std::size_t WilhelmCBC::decryptRange (std::size_t offset, std::size_t length)
+{
+	const std::size_t fileSize = _inputSize;
+
+	if (_streamingInput)
+		throw std::runtime_error ("INPUT CANNOT SEEK");
+
+	// The plaintext is never longer than the input
+	length = offset < _inputSize ? std::min(length, _inputSize-offset) : 0;
+	beginDecrypt(length);
+
+	// Header, IV and at least one block, the padding block and the hash
+	if (_inputSize < 3*BLOCK_BYTES)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	const std::size_t clusterBlocks = _clusterBytes/BLOCK_BYTES;	// As the header gives it
+	const std::size_t dataStart = fileSize-_inputSize - (_inputIndexed ? indexFooterBytes(_indexClusters) : 0);
+	std::vector<Block> & entries = _arena.indexEntries;
+	const std::size_t fullClusters = (_inputSize-2*BLOCK_BYTES-1)/_clusterBytes;
+
+	// Clusters holding the range, the last cluster at most
+	const std::size_t end = offset+length;
+	std::size_t written = 0;
+	std::size_t firstCluster = std::min(offset/_clusterBytes, fullClusters);
+	std::size_t endCluster = length ? std::min((end-1)/_clusterBytes, fullClusters)+1 : firstCluster;
+
+	// Writes the part of the plaintext at stream position start that falls in the range
+	auto writeRange = [&] (const Block * plain, std::size_t start, std::size_t bytes)
+	{
+		std::size_t from = std::max(offset, start);
+		std::size_t to = std::min(end, start+bytes);
+		if (from < to)
+		{
+			writeOutput((const unsigned char *)plain + (from-start), to-from);
+			written += to-from;
+		}
+	};
+
+	// Indexed files only. Stops at a cluster that does not match its entry, with the output cut to what was written.
+	auto checkEntry = [&] (const Block & entry, std::size_t clusterIndex, const Block & clusterHash)
+	{
+		if (!indexEntryMatches(entry, clusterIndex, clusterHash))
+		{
+			closeOutput();
+			throw std::runtime_error ("CLUSTER HASH MISMATCH");
+		}
+	};
+
+	if (firstCluster < endCluster)
+	{
+		// Same state the serial loop has at the start of firstCluster. Its chain value is the block before it, or the IV.
+		_clusterNum = firstCluster;
+		_blockNum = firstCluster*(clusterBlocks-1);
+		_indexToStream = firstCluster*_clusterBytes;
+		if (firstCluster)
+		{
+			seekInput(dataStart + _indexToStream - BLOCK_BYTES);
+			if (readInput(&_lastBlockPrevCluster.data[0], BLOCK_BYTES) != BLOCK_BYTES)
+				throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+		}
+	}
+
+	// Full clusters, in batches across the pool
+	std::size_t batchEnd = std::min(endCluster, fullClusters);
+	if (firstCluster < batchEnd)
+	{
+		WorkerPool pool (_threads);
+		const std::size_t batchClusters = std::max<std::size_t>(pool.size()*PARALLEL_BATCH_BYTES/_clusterBytes, 1);
+		std::vector<Block> & encrypted = _arena.inputSlots[0];
+		std::vector<Block> & decrypted = _arena.outputSlots[0];
+
+		while (_clusterNum < batchEnd)
+		{
+			std::size_t count = std::min<std::size_t>(batchClusters, batchEnd-_clusterNum);
+			std::size_t first = _clusterNum;
+			std::size_t start = _indexToStream;
+			if (_inputIndexed)
+				readIndexEntries(first, count, dataStart + start, entries);
+
+			encrypted.resize(count*clusterBlocks);
+			decrypted.resize(count*clusterBlocks);
+			if (readInput(&encrypted[0], count*_clusterBytes) != count*_clusterBytes)
+				throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+
+			decryptBatch(&encrypted[0], &decrypted[0], count, pool);
+			for (std::size_t i = 0; i < count && _inputIndexed; i++)
+				checkEntry(entries[i], first+i, _arena.batchHashes[i]);
+			writeRange(&decrypted[0], start, count*_clusterBytes);
+		}
+	}
+
+	// The last cluster, with the padding block that gives the plaintext size
+	if (endCluster > fullClusters)
+	{
+		std::size_t clusterStart = _indexToStream;
+		if (_inputIndexed)
+			readIndexEntries(fullClusters, 1, dataStart + clusterStart, entries);
+
+		_currentBlockSet.resize((_inputSize-clusterStart)/BLOCK_BYTES);
+		if (readInput(&_currentBlockSet[0], _currentBlockSet.size()*BLOCK_BYTES) != _currentBlockSet.size()*BLOCK_BYTES)
+			throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+		_indexToStream = _inputSize;
+
+		// Padding block off before hashing, as in decrypt()
+		decCBC();
+		_currentBlockSet.resize(_currentBlockSet.size()-1);
+		if (_inputIndexed)
+			checkEntry(entries[0], fullClusters, Hash_SHA256_Current_Cluster());
+		writeRange(&_currentBlockSet[0], clusterStart, _inputSize-clusterStart);
+	}
+
+	closeOutput();
+
+	// Cleanup
+	_indexToStream = 0;
+	_currentBlockSet.clear();
+	_blockNum = 0;
+	_clusterNum = 0;
+
+	return written;
+}
+
 // Private Methods
 
-// Encrypts a cluster
-void WilhelmCBC::encCBC()
+// Checks that encrypt() can run and writes out a new IV
+void WilhelmCBC::beginEncrypt ()
 {
-	// finds number of blocks to be processed in for loop below. Does not process any trailing/last block (for padding calculation).
-	unsigned long relativeBlockCount;
+	if (!_ifile.is_open() && !_inputMap.isOpen() && !_uring.inputOpen() && !_memoryIO)
+        throw std::runtime_error ("NO INPUT FILE HAS BEEN OPENED");
+	if (!_ofile.is_open() && !_uring.outputOpen() && !_memoryIO)
+        throw std::runtime_error ("NO OUTPUT FILE HAS BEEN SET");
+	if (_baseKey == Block())
+        throw std::runtime_error ("NO PASSWORD HAS BEEN SET");
+	// Before the output is sized or written, so nothing is left behind. Streaming input is read one byte ahead to tell.
+	std::size_t knownSize = _inputSize;
+	if (_streamingInput)
+		findInputEnd(0, 0, knownSize);
+	if (knownSize == 0)
+		throw std::runtime_error ("INPUT FILE IS EMPTY");
 
-	if (_indexToStream >= _inputSize)
+	// Output is at most the input plus header, IV, padding, padded last block and hash, and the index
+	std::size_t clusters = std::max<std::size_t>((_inputSize+_clusterBytes-1)/_clusterBytes, 1);
+	mapOutput(_inputSize + 5*BLOCK_BYTES + (_writeIndex ? indexFooterBytes(clusters) : 0));
+	_lastCluster = false;
+	_collectDigests = _writeIndex;
+	_clusterDigests.clear();
+	_indexSpool.reset();
+	_spooledEntries = 0;
+	_fileMode = _cipherMode;
+
+	writeHeader();
+	_clusterHashes.reset(_integrityMode);
+
+	// Room for the padding block encCBC adds to a full last cluster
+	_currentBlockSet.reserve(_clusterBytes/BLOCK_BYTES+1);
+
+	// Create IV
+	_lastBlockPrevCluster = IVGenerator();
+	_fileIV = _lastBlockPrevCluster;
+
+	// Write IV
+	writeOutput(&_lastBlockPrevCluster.data[0], BLOCK_BYTES);
+}
+
+// Writes the header block that precedes the IV: magic, file version and cluster size (little endian)
+void WilhelmCBC::writeHeader ()
+{
+	Block header = Block();
+	memcpy(&header.data[0], HEADER_MAGIC, sizeof(HEADER_MAGIC));
+	header.data[8] = FILE_VERSION;
+	header.data[9] = (unsigned char)_integrityMode;
+	header.data[10] = (unsigned char)_fileMode;
+	header.data[11] = _writeIndex ? HEADER_FLAG_INDEX : 0;
+
+	for (unsigned int i = 0; i < 4; i++)
+		header.data[12+i] = (unsigned char)(_clusterBytes >> (8*i));
+
+	writeOutput(&header.data[0], BLOCK_BYTES);
+}
+
+// Checks that decrypt() or decryptRange() can run, maps up to maxOutput bytes of output and reads the header and IV
+void WilhelmCBC::beginDecrypt (std::size_t maxOutput)
+{
+	if (!_ifile.is_open() && !_inputMap.isOpen() && !_uring.inputOpen() && !_memoryIO)
+        throw std::runtime_error ("NO INPUT FILE HAS BEEN OPENED");
+	if (_inputSize == 0)
+		throw std::runtime_error ("INPUT FILE IS EMPTY");
+	if (_inputSize % BLOCK_BYTES) // All encrypted files are a multiple of BLOCK_BYTES long
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	if (!_ofile.is_open() && !_uring.outputOpen() && !_memoryIO)
+        throw std::runtime_error ("NO OUTPUT FILE HAS BEEN SET");
+	if (_baseKey == Block())
+        throw std::runtime_error ("NO PASSWORD HAS BEEN SET");
+
+	mapOutput(maxOutput);
+	_lastCluster = false;
+	_collectDigests = false;
+
+	// Read header, if any, and IV
+	readHeaderAndIV();
+}
+
+// Reads the header and IV at the start of an encrypted file, and takes them off _inputSize.
+// Indexed files also have their footer read, and taken off _inputSize, see readIndexTrailer.
+// Files from before the header existed start right with the IV, which only matches the magic by chance (1 in 2^64),
+//	and always use CLUSTER_BYTES clusters.
+void WilhelmCBC::readHeaderAndIV ()
+{
+	Block first;
+	if (readInput(&first.data[0], BLOCK_BYTES) != BLOCK_BYTES)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	_inputSize -= BLOCK_BYTES;
+	_inputIndexed = false;
+	_fileMode = MODE_CBC;
+
+	if (memcmp(&first.data[0], HEADER_MAGIC, sizeof(HEADER_MAGIC)))
 	{
-		relativeBlockCount = (_inputSize%CLUSTER_BYTES)/BLOCK_BYTES;
-		if (!(_inputSize%BLOCK_BYTES))
-			relativeBlockCount--;
+		// No header, this was the IV
+		_clusterBytes = CLUSTER_BYTES;
+		_clusterHashes.reset(HashTree::FLAT);
+		_lastBlockPrevCluster = first;
+		_fileIV = first;
+		return;
 	}
-	else 
-		relativeBlockCount = CLUSTER_BYTES/BLOCK_BYTES-1;
 
-	_currentBlock = (Block*)&_currentBlockSet[0];
-	*_currentBlock = *_currentBlock ^ _lastBlockPrevCluster;
-	for (; _currentBlock != (Block*)&_currentBlockSet[0]+relativeBlockCount; ++_currentBlock, ++_blockNum)
+	// Version 1 had no algorithm or flags, and left their bytes zero
+	if (first.data[8] == 0 || first.data[8] > FILE_VERSION)
+		throw std::runtime_error ("UNSUPPORTED ENCRYPTED FILE VERSION");
+	if (first.data[10] > MODE_XEX)
+		throw std::runtime_error ("UNSUPPORTED ENCRYPTED FILE ALGORITHM");
+	_fileMode = (CipherMode)first.data[10];
+	if (first.data[11] & ~HEADER_FLAG_INDEX)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	_inputIndexed = (first.data[11] & HEADER_FLAG_INDEX) != 0;
+
+	std::size_t clusterBytes = 0;
+	for (unsigned int i = 0; i < 4; i++)
+		clusterBytes |= (std::size_t)first.data[12+i] << (8*i);
+
+	if (!validClusterSize(clusterBytes) || first.data[9] > HashTree::MERKLE || _inputSize < BLOCK_BYTES)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	_clusterBytes = clusterBytes;
+	_clusterHashes.reset((HashTree::Mode)first.data[9]);
+
+	// Read IV
+	if (readInput(&_lastBlockPrevCluster.data[0], BLOCK_BYTES) != BLOCK_BYTES)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	_inputSize -= BLOCK_BYTES; // Less file size for IV
+	_fileIV = _lastBlockPrevCluster;
+
+	// Streaming input finds the index as it gets there, see findIndexStart
+	if (_inputIndexed && !_streamingInput)
+		readIndexTrailer();
+}
+
+// Reads the index block at the end of an indexed file, checks it against the file size, and takes the footer
+// (both index blocks and an entry per cluster) off _inputSize. Leaves the input at the first cluster.
+void WilhelmCBC::readIndexTrailer ()
+{
+	const std::size_t dataStart = 2*BLOCK_BYTES;	// Header and IV
+
+	Block trailer;
+	seekInput(dataStart + _inputSize - BLOCK_BYTES);
+	if (_inputSize < BLOCK_BYTES || readInput(&trailer.data[0], BLOCK_BYTES) != BLOCK_BYTES
+		|| memcmp(&trailer.data[0], INDEX_MAGIC, sizeof(INDEX_MAGIC)))
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+
+	// The clusters left once the footer is off have to be the ones the index lists
+	std::size_t clusters = (std::size_t)readLE64(&trailer.data[8]);
+	if (clusters == 0 || clusters > _inputSize/BLOCK_BYTES || _inputSize < indexFooterBytes(clusters) + 3*BLOCK_BYTES)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	_inputSize -= indexFooterBytes(clusters);
+	if ((_inputSize-2*BLOCK_BYTES-1)/_clusterBytes+1 != clusters)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+
+	_indexClusters = clusters;
+	seekInput(dataStart);
+}
+
+// Streaming input only. Looks through the read ahead input for the index block that follows the last cluster's
+// padding block and hash, and sets _inputSize to where it starts once found. Returns true if it was found.
+// The earliest it can be is after one data block, the latest after a full cluster.
+bool WilhelmCBC::findIndexStart ()
+{
+	const std::size_t available = _lookahead.size()-_lookaheadStart;
+
+	for (std::size_t at = 3*BLOCK_BYTES; at <= _clusterBytes + 2*BLOCK_BYTES && at + BLOCK_BYTES <= available; at += BLOCK_BYTES)
 	{
-		// Encrypt current block, then perform CBC
-		blockEnc();
-		*(_currentBlock+1) = *(_currentBlock+1) ^ *_currentBlock;
+		const unsigned char * block = &_lookahead[_lookaheadStart + at];
+		if (!memcmp(block, INDEX_MAGIC, sizeof(INDEX_MAGIC)) && readLE64(block+8) == _clusterNum+1)
+		{
+			_inputSize = _indexToStream + at;
+			_indexClusters = _clusterNum+1;
+			return true;
+		}
 	}
+	return false;
+}
 
-	// Last block in cluster
-	blockEnc();
-	_lastBlockPrevCluster = *_currentBlock;
-	
-	// If on last cluster of file
-	if (_indexToStream >= _inputSize)
+// Index block, the footer's first and last block: INDEX_MAGIC, then the number of clusters
+WilhelmCBC::Block WilhelmCBC::indexBlock (std::size_t clusters)
+{
+	Block b = Block();
+	memcpy(&b.data[0], INDEX_MAGIC, sizeof(INDEX_MAGIC));
+	writeLE64(&b.data[8], clusters);
+	return b;
+}
+
+// Writes the footer index after the hash: an index block, one entry per cluster, and the index block again.
+// Spooled entries are copied out INDEX_SPOOL_ENTRIES at a time, ahead of the ones still in _clusterDigests.
+void WilhelmCBC::writeIndex ()
+{
+	makeIndexEntries();
+
+	Block index = indexBlock(_spooledEntries + _clusterDigests.size());
+	writeOutput(&index.data[0], BLOCK_BYTES);
+
+	if (_indexSpool)
 	{
-		// Insert padding block after padded block
-		// Need to keep _currentBlock pointer at same index after potentially reallocating.
+		std::rewind(_indexSpool.get());
+		std::vector<Block> entries (std::min<std::size_t>(_spooledEntries, INDEX_SPOOL_ENTRIES));
+		for (std::size_t left = _spooledEntries; left; )
+		{
+			std::size_t count = std::min(left, entries.size());
+			if (std::fread(&entries[0], BLOCK_BYTES, count, _indexSpool.get()) != count)
+				throw std::runtime_error ("COULD NOT READ INDEX SPOOL FILE");
+			writeOutput(&entries[0], count*BLOCK_BYTES);
+			left -= count;
+		}
+		_indexSpool.reset();
+	}
 
-		std::size_t temp = 0;
-		for (std::vector<Block>::iterator i = _currentBlockSet.begin();
-				i != _currentBlockSet.end(); i++, temp++);
+	if (!_clusterDigests.empty())
+		writeOutput(&_clusterDigests[0], _clusterDigests.size()*BLOCK_BYTES);
+	writeOutput(&index.data[0], BLOCK_BYTES);
+	_clusterDigests.clear();
+	_spooledEntries = 0;
+}
 
-		_currentBlockSet.push_back( Padding(*_currentBlock));
+// Turns the digests in _clusterDigests into index entries in place, numbering the clusters on from the spooled ones.
+// Each entry is the cluster's file offset, then INDEX_DIGEST_BYTES of its clusterDigest.
+void WilhelmCBC::makeIndexEntries ()
+{
+	const std::size_t dataStart = 2*BLOCK_BYTES;	// Header and IV
 
-		_currentBlock = ((Block*)&_currentBlockSet[temp]);
-		
-		*(_currentBlock) = *(_currentBlock) ^ *(_currentBlock-1);
-		
-		// Encrypt padding block.
-		++_blockNum;
-		blockEnc();
+	for (std::size_t i = 0; i < _clusterDigests.size(); i++)
+	{
+		Block & entry = _clusterDigests[i];
+		memmove(&entry.data[8], &entry.data[0], INDEX_DIGEST_BYTES);
+		writeLE64(&entry.data[0], dataStart + (_spooledEntries + i)*_clusterBytes);
 	}
+}
 
-	// Increment Cluster number
-	_clusterNum++;
+// Moves the full _clusterDigests out to the spool file as index entries, creating the file the first time
+void WilhelmCBC::spoolIndexEntries ()
+{
+	makeIndexEntries();
+
+	if (!_indexSpool)
+	{
+		_indexSpool.reset(std::tmpfile());
+		if (!_indexSpool)
+			throw std::runtime_error ("COULD NOT CREATE INDEX SPOOL FILE");
+	}
+	if (std::fwrite(&_clusterDigests[0], BLOCK_BYTES, _clusterDigests.size(), _indexSpool.get()) != _clusterDigests.size())
+		throw std::runtime_error ("COULD NOT WRITE INDEX SPOOL FILE");
+
+	_spooledEntries += _clusterDigests.size();
+	_clusterDigests.clear();
 }
 
-// Decrypts a cluster, if last cluster returns HMAC block
-WilhelmCBC::Block WilhelmCBC::decCBC()
+// Reads the index entries of count clusters from firstCluster on into entries, and puts the input back where it was.
+// position is where the input is now, from the start of the file.
+void WilhelmCBC::readIndexEntries (std::size_t firstCluster, std::size_t count, std::size_t position, std::vector<Block> & entries)
 {
-	// finds number of blocks to be processed in for loop below. Any correct encrypted file is a multple of BLOCK_BYTES.
-	unsigned long relativeBlockCount;
+	const std::size_t dataStart = 2*BLOCK_BYTES;	// Header and IV
 
-	if (_indexToStream >= _inputSize)
+	// Entries follow the hash and the first index block
+	entries.resize(count);
+	seekInput(dataStart + _inputSize + (1+firstCluster)*BLOCK_BYTES);
+	if (count && readInput(&entries[0], count*BLOCK_BYTES) != count*BLOCK_BYTES)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+	seekInput(position);
+}
+
+// Whether the index entry of cluster clusterIndex matches the hash of its decrypted plaintext
+bool WilhelmCBC::indexEntryMatches (const Block & entry, std::size_t clusterIndex, const Block & clusterHash) const
+{
+	Block digest = clusterDigest(clusterHash);
+	return readLE64(&entry.data[0]) == 2*BLOCK_BYTES + clusterIndex*_clusterBytes
+		&& !memcmp(&entry.data[8], &digest.data[0], INDEX_DIGEST_BYTES);
+}
+
+// Bytes the footer index takes for clusters clusters
+std::size_t WilhelmCBC::indexFooterBytes (std::size_t clusters)
+{
+	return (clusters+2)*BLOCK_BYTES;
+}
+
+// Reads the next plaintext cluster into _currentBlockSet. Sets _lastCluster once the last cluster is read.
+void WilhelmCBC::readPlainCluster ()
+{
+	_lastCluster = readPlainCluster(_currentBlockSet, _indexToStream, _inputSize);
+
+	// Update pos in stream.
+	_indexToStream = _lastCluster ? _inputSize : _indexToStream+_clusterBytes;
+}
+
+// Reads the plaintext cluster starting at stream position index into blocks. Returns true for the last cluster.
+// Only touches the input and inputSize, its copy of _inputSize, so the pipeline's reader can run it while another thread encrypts.
+// Streaming input looks one cluster ahead to learn whether this is the last one, and sets inputSize when it is.
+bool WilhelmCBC::readPlainCluster (std::vector<Block> & blocks, std::size_t index, std::size_t & inputSize)
+{
+	if (_streamingInput)
+		findInputEnd(index, _clusterBytes, inputSize);
+
+	std::size_t bytes;
+	bool last = plainClusterSize(index, inputSize, blocks, bytes);
+	readInput(&blocks[0], bytes);
+	return last;
+}
+
+// Sizes blocks for the plaintext cluster starting at stream position index, and sets the input bytes it takes.
+// Returns true for the last cluster, which is <= _clusterBytes and may end in a partial block.
+bool WilhelmCBC::plainClusterSize (std::size_t index, std::size_t inputSize, std::vector<Block> & blocks, std::size_t & bytes) const
+{
+	// Full cluster, every byte gets read over
+	if (index + _clusterBytes < inputSize)
 	{
-		_inputSize -= BLOCK_BYTES; // Discount the HMAC block - do not process.
-		relativeBlockCount = (_inputSize%CLUSTER_BYTES)/BLOCK_BYTES;
+		blocks.resize(_clusterBytes/BLOCK_BYTES);
+		bytes = _clusterBytes;
+		return false;
 	}
-	else 
-		relativeBlockCount = CLUSTER_BYTES/BLOCK_BYTES-1;
 
-	// Copy that stay's encrypted for use in CBC unwrapping
-	std::vector <Block> encrypted = _currentBlockSet;
-	Block * undecrypted = (Block*)&encrypted[0];
+	// Last cluster, rest of file. Zeroed, as the last block may only be partly read
+	bytes = inputSize-index;
+	blocks.assign((bytes+BLOCK_BYTES-1)/BLOCK_BYTES, Block());
+	return true;
+}
+
+// Writes out the encrypted cluster in _currentBlockSet
+void WilhelmCBC::writeCipherCluster ()
+{
+	writeOutput(&_currentBlockSet[0], cipherClusterBytes());
 
-	// Decrypt the first block
-	_currentBlock = (Block*)&_currentBlockSet[0];
-	blockDec();
-	*_currentBlock = *_currentBlock ^ _lastBlockPrevCluster;
-	_currentBlock++;
-	++_blockNum;
-	
-	for (; _currentBlock != (Block*)&_currentBlockSet[0]+relativeBlockCount; ++_currentBlock, ++_blockNum)
+	// Left at its size, so the next full cluster resizes without zeroing. finishEncrypt clears it.
+}
+
+// Bytes of the encrypted cluster in _currentBlockSet that go to the output.
+// Every block, the last cluster's padded last block and the padding block encCBC added included.
+std::size_t WilhelmCBC::cipherClusterBytes () const
+{
+	return _currentBlockSet.size()*BLOCK_BYTES;
+}
+
+// Encrypts the whole input through io_uring, reading clusters ahead and writing them behind from one thread.
+// Returns false, without touching the files, if the files are not on io_uring or no ring could be set up.
+bool WilhelmCBC::encryptUring ()
+{
+	if (!_uring.inputOpen() || !_uring.outputOpen())
+		return false;
+
+	// Slots stay at full size so their buffers never move while registered, and keep room for the padding block encCBC adds
+	const std::size_t slotCapacity = _clusterBytes/BLOCK_BYTES+2;
+	std::vector<Block> * slotBlocks = _arena.inputSlots;
+	std::vector<unsigned char *> buffers;
+	for (std::size_t slot = 0; slot < PIPELINE_SLOTS; slot++)
 	{
-		blockDec();
-		*(_currentBlock) = *(_currentBlock) ^ *undecrypted++;
+		slotBlocks[slot].resize(slotCapacity);
+		buffers.push_back(&slotBlocks[slot][0].data[0]);
 	}
 
+	std::size_t slotEnd[PIPELINE_SLOTS];		// Stream position after the slot's cluster
+	std::size_t readIndex = _indexToStream;
+
+	bool ran = _uring.run(buffers, buffers, slotCapacity*BLOCK_BYTES, _inputOffset, _outputOffset, [&] (std::size_t slot, std::size_t & bytes)
+	{
+		bool last = plainClusterSize(readIndex, _inputSize, slotBlocks[slot], bytes);
+		readIndex = last ? _inputSize : readIndex+_clusterBytes;
+		slotEnd[slot] = readIndex;
+		return last;
+	},
+	[&] (std::size_t slot)
+	{
+		_currentBlockSet.swap(slotBlocks[slot]);
+		_indexToStream = slotEnd[slot];
+
+		// Hash cluster before encrypting
+		addClusterHash(Hash_SHA256_Current_Cluster());
+		encCBC();
+		std::size_t bytes = cipherClusterBytes();
+
+		_currentBlockSet.swap(slotBlocks[slot]);
+		return bytes;
+	});
+
+	if (ran)
+		_lastCluster = true;
+	return ran;
+}
+
+// Encrypts the whole input with reading, hashing and encrypting, and writing overlapped in a ClusterPipeline.
+// The crypto stage swaps each slot into _currentBlockSet, so it runs the same encCBC() as the serial loop.
+void WilhelmCBC::encryptPipelined ()
+{
+	ClusterPipeline pipeline (PIPELINE_SLOTS);
+	std::vector<Block> * slotBlocks = _arena.inputSlots;
+	std::size_t slotEnd[PIPELINE_SLOTS];		// Stream position after the slot's cluster
+	std::size_t slotInputSize[PIPELINE_SLOTS];	// Input size as the reader knew it, it finds the end of streaming input
+	std::size_t slotBytes[PIPELINE_SLOTS];		// Encrypted bytes to write
+	std::size_t readIndex = _indexToStream;
+	std::size_t readerInputSize = _inputSize;
+
+	// Room for the padding block encCBC adds to a full last cluster
+	for (std::size_t slot = 0; slot < PIPELINE_SLOTS; slot++)
+		slotBlocks[slot].reserve(_clusterBytes/BLOCK_BYTES+1);
+
+	pipeline.run([&] (std::size_t slot)
+	{
+		bool last = readPlainCluster(slotBlocks[slot], readIndex, readerInputSize);
+		readIndex = last ? readerInputSize : readIndex+_clusterBytes;
+		slotEnd[slot] = readIndex;
+		slotInputSize[slot] = readerInputSize;
+		return last;
+	},
+	[&] (std::size_t slot)
+	{
+		_currentBlockSet.swap(slotBlocks[slot]);
+		_indexToStream = slotEnd[slot];
+		_inputSize = slotInputSize[slot];
+
+		// Hash cluster before encrypting
+		addClusterHash(Hash_SHA256_Current_Cluster());
+		encCBC();
+		slotBytes[slot] = cipherClusterBytes();
+
+		_currentBlockSet.swap(slotBlocks[slot]);
+	},
+	[&] (std::size_t slot)
+	{
+		writeOutput(&slotBlocks[slot][0], slotBytes[slot]);
+	});
+
+	_lastCluster = true;
+}
+
+// Writes out the hash of all cluster hashes and resets for the next operation
+void WilhelmCBC::finishEncrypt ()
+{
+	// Root of the cluster hashes, written out to file
+	Block hashesTemp = finishClusterHashes();
+
+	writeOutput(&hashesTemp.data[0], BLOCK_BYTES);
+	if (_collectDigests)
+		writeIndex();
+	closeOutput();
+
+	// Cleanup
+	_indexToStream = 0;
+	_currentBlockSet.clear();
+	_blockNum = 0;
+	_clusterNum = 0;
+}
+
+// Encrypts a cluster
+void WilhelmCBC::encCBC()
+{
+	// Every block, up to the padded last block if this is the last cluster, encrypted in place.
+	// XEX files go on from the cluster's first tweak instead of the chain.
+	std::size_t blockCount = _currentBlockSet.size();
+	Block tweak;
+	if (_fileMode == MODE_XEX)
+	{
+		tweak = CipherCore::clusterTweak(_keySchedule, _clusterNum, _fileIV);
+		CipherCore::encryptBlocksXEX(_keySchedule, _clusterNum, _blockNum, &_currentBlockSet[0], &_currentBlockSet[0], blockCount, tweak);
+		_lastBlockPrevCluster = _currentBlockSet.back();
+	}
+	else
+		CipherCore::encryptBlocks(_keySchedule, _clusterNum, _blockNum, &_currentBlockSet[0], &_currentBlockSet[0], blockCount, _lastBlockPrevCluster);
+	_blockNum += blockCount-1;
+
 	// If on last cluster of file
 	if (_indexToStream >= _inputSize)
 	{
-		// Recovering Padding Size location
-		Block * paddingBlock = --_currentBlock;
-		Block tempBlock = *(--undecrypted);
-		Hash_SHA256_Block(tempBlock);
-		unsigned long temppos = (tempBlock.data[0])%BLOCK_BYTES;
+		// Insert padding block after padded block, CBC'd onto it (or tweaked) and encrypted as the next block.
+		// Its chain value is only needed for a following cluster, and there is none.
+		Block chain = _lastBlockPrevCluster;
+		_currentBlockSet.push_back(Padding(chain));
 
-		// Extract obfuscated location of number of meaningful bits, modify inputSize to be the size of unencrypted input
-			// Less the padding block, less the padded block, more the number of meaningful bytes in the padded block.
+		++_blockNum;
+		if (_fileMode == MODE_XEX)
+			CipherCore::encryptBlocksXEX(_keySchedule, _clusterNum, _blockNum, &_currentBlockSet.back(), &_currentBlockSet.back(), 1, tweak);
+		else
+			CipherCore::encryptBlocks(_keySchedule, _clusterNum, _blockNum, &_currentBlockSet.back(), &_currentBlockSet.back(), 1, chain);
+	}
 
-		_inputSize += paddingBlock->data[temppos];
-		_inputSize -= BLOCK_BYTES + BLOCK_BYTES;
+	// Increment Cluster number
+	_clusterNum++;
+}
 
-		Block hashChecksum = *(++_currentBlock);
-		// Removing hmac before write out to file
-		_currentBlockSet.resize(_currentBlockSet.size()-1);
-		
-		// Return hash checksum for comaprison
-		return hashChecksum;
+// Encrypts the full (non final) clusters loaded in several objects in lockstep.
+// Each CBC chain is serial, but the chains are independent, so block j of every lane goes through the Feistel rounds together.
+void WilhelmCBC::encCBCInterleaved (WilhelmCBC * const * lanes, std::size_t laneCount)
+{
+	// All lanes share one cluster size
+	const std::size_t clusterBlocks = laneCount ? lanes[0]->_clusterBytes/BLOCK_BYTES : 0;
+	Block * blocks[ENCRYPT_LANES];
+	LRSide blockKeys[ENCRYPT_LANES];
+
+	for (std::size_t i = 0; i < clusterBlocks; i++)
+	{
+		// CBC, then gather this step's block from every lane
+		for (std::size_t lane = 0; lane < laneCount; lane++)
+		{
+			WilhelmCBC & c = *lanes[lane];
+			Block * block = &c._currentBlockSet[i];
+			*block = *block ^ (i ? *(block-1) : c._lastBlockPrevCluster);
+
+			blocks[lane] = block;
+			blockKeys[lane] = CipherCore::blockKey(c._keySchedule, c._clusterNum, c._blockNum+i);
+		}
+
+		CipherCore::blockEncLanes(blocks, blockKeys, laneCount);
+	}
+
+	// Same state encCBC leaves behind for a full cluster
+	for (std::size_t lane = 0; lane < laneCount; lane++)
+	{
+		WilhelmCBC & c = *lanes[lane];
+		c._lastBlockPrevCluster = c._currentBlockSet[clusterBlocks-1];
+		c._blockNum += clusterBlocks-1;
+		c._clusterNum++;
 	}
-	else // Not the last cluster
+}
+
+// Decrypts a cluster, if last cluster returns HMAC block
+WilhelmCBC::Block WilhelmCBC::decCBC()
+{
+	Block * blocks = &_currentBlockSet[0];
+
+	// Not the last cluster, decrypted in place
+	if (_indexToStream < _inputSize)
 	{
-		// Decrypt the last encrypted block
-		blockDec();
-		*(_currentBlock) = *(_currentBlock) ^ *undecrypted++;
-		// Save the last encrypted to start off the CBC in the next cluster
-		_lastBlockPrevCluster = *undecrypted;
+		decryptClusterBlocks(blocks, _currentBlockSet.size());
+		_blockNum += _currentBlockSet.size()-1;
 
 		// Increment Cluster
 		_clusterNum++;
 		
 		return Block(); // We don't care what block we return if it's not the last one
 	}
+
+	// Last cluster: data blocks, the padding block, then the HMAC, which is not decrypted
+	_inputSize -= BLOCK_BYTES; // Discount the HMAC block - do not process.
+	std::size_t blockCount = _currentBlockSet.size()-1;
+	Block hashChecksum = blocks[blockCount];
+
+	// Recovering Padding Size location, from the last data block while it's still encrypted
+	Block tempBlock = blocks[blockCount-2];
+	Hash_SHA256_Block(tempBlock);
+	unsigned long temppos = (tempBlock.data[0])%BLOCK_BYTES;
+
+	decryptClusterBlocks(blocks, blockCount);
+	const Block & paddingBlock = blocks[blockCount-1];
+
+	// Extract obfuscated location of number of meaningful bits, modify inputSize to be the size of unencrypted input
+		// Less the padding block, less the padded block, more the number of meaningful bytes in the padded block.
+
+	// A count of 0 comes from a last block that was already full (the input size was a multiple of BLOCK_BYTES)
+	_inputSize += paddingBlock.data[temppos] ? paddingBlock.data[temppos] : BLOCK_BYTES;
+	_inputSize -= BLOCK_BYTES + BLOCK_BYTES;
+
+	// Removing hmac before write out to file
+	_currentBlockSet.resize(blockCount);
+	
+	// Return hash checksum for comaprison
+	return hashChecksum;
 }
 
-// Encrypts the current block
-void WilhelmCBC::blockEnc()
+// Decrypts the first blockCount blocks of the current cluster in place, by the file's mode of operation
+void WilhelmCBC::decryptClusterBlocks (Block * blocks, std::size_t blockCount)
 {
-	_currentL = (LRSide *)_currentBlock;
-	_currentR = &_currentL[1];
-
-	for (_roundNum = 0; _roundNum < FEISTEL_ROUNDS; _roundNum++)
-		roundEnc();
+	if (_fileMode == MODE_XEX)
+	{
+		Block tweak = CipherCore::clusterTweak(_keySchedule, _clusterNum, _fileIV);
+		Block lastCipher = blocks[blockCount-1];
+		CipherCore::decryptBlocksXEX(_keySchedule, _clusterNum, _blockNum, blocks, blocks, blockCount, tweak);
+		_lastBlockPrevCluster = lastCipher;
+	}
+	else
+		CipherCore::decryptBlocks(_keySchedule, _clusterNum, _blockNum, blocks, blocks, blockCount, _lastBlockPrevCluster);
 }
 
-// Decrypts the current block
-void WilhelmCBC::blockDec()
+// Hashes the next count (up to HASH_AHEAD_CLUSTERS) full clusters of the input mapping together,
+// then encrypts them one after another directly into the output mapping
+void WilhelmCBC::encryptMappedClusters (std::size_t count)
 {
-	_currentL = (LRSide *)_currentBlock;
-	_currentR = &_currentL[1];
+	const std::size_t clusterBlocks = _clusterBytes/BLOCK_BYTES;
+	const Block * in = (const Block *)mappedInput(count*_clusterBytes);
+	Block * out = (Block *)mappedOutput(count*_clusterBytes);
+
+	Block hashes[HASH_AHEAD_CLUSTERS];
+	Hash_SHA256_Clusters(in, clusterBlocks, count, hashes);
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		addClusterHash(hashes[i]);
+		if (_fileMode == MODE_XEX)
+		{
+			CipherCore::encryptClusterXEX(_keySchedule, _clusterNum, _fileIV, in, out, _clusterBytes, _clusterBytes);
+			_lastBlockPrevCluster = out[clusterBlocks-1];
+		}
+		else
+			CipherCore::encryptCluster(_keySchedule, _clusterNum, in, out, _clusterBytes, _clusterBytes, _lastBlockPrevCluster);
 
-	for (_roundNum = FEISTEL_ROUNDS-1; _roundNum != 0; _roundNum--)
-		roundDec();
-	// Last round
-	roundDec();
+		// Same state encCBC leaves behind for a full cluster
+		_blockNum += clusterBlocks-1;
+		_clusterNum++;
+		_indexToStream += _clusterBytes;
+		in += clusterBlocks;
+		out += clusterBlocks;
+	}
 }
 
-// Performs a Feistel round for encryption
-void WilhelmCBC::roundEnc()
+// Encrypts (XEX files only) or decrypts, and hashes, every cluster before the last one, in batches spread over a WorkerPool.
+// Decrypting, each cluster only needs the last ciphertext block of the one before it, which is already in the batch.
+// XEX clusters need nothing from each other either way.
+// Mapped files go straight between the mappings, streams go through a ClusterPipeline of batches.
+void WilhelmCBC::cryptClustersParallel (bool encrypting)
 {
-	*_currentL = *_currentL ^ feistel(*_currentR);
-	*_currentR = *_currentR ^ feistel(*_currentL);
+	const std::size_t clusterBlocks = _clusterBytes/BLOCK_BYTES;
+
+	// Number of clusters the serial loop in encrypt() or decrypt() would read before reaching the last one.
+	// Ciphertext has the padding block and hash after the last cluster. Streaming input has no known end, the serial loop reads it all.
+	const std::size_t trailer = encrypting ? 0 : 2*BLOCK_BYTES;
+	if (_streamingInput || _indexToStream + trailer >= _inputSize)
+		return;
+	std::size_t remainingClusters = (_inputSize-_indexToStream-trailer-1)/_clusterBytes;
+	if (remainingClusters == 0)
+		return;
+
+	WorkerPool pool (_threads);
+	std::size_t batchClusters = std::max<std::size_t>(pool.size()*PARALLEL_BATCH_BYTES/_clusterBytes, 1);
+	batchClusters = std::min(batchClusters, remainingClusters);
+
+	auto runBatch = [&] (const Block * in, Block * out, std::size_t count)
+	{
+		if (encrypting)
+			encryptBatchXEX(in, out, count, pool);
+		else
+			decryptBatch(in, out, count, pool);
+	};
+
+	std::vector<Block> * inSlots = _arena.inputSlots;
+	std::vector<Block> * outSlots = _arena.outputSlots;
+	std::size_t slotClusters[PIPELINE_SLOTS];
+
+	// Straight from and to the mapped pages, or caller memory
+	std::size_t mappedBytes;
+	if (inputMapping(mappedBytes) && outputMapping(mappedBytes))
+	{
+		// Decrypting a buffer onto itself, the plaintext lands behind the ciphertext it came from and would overwrite
+		//	ciphertext other clusters still read, so each batch is copied out first. Nothing after the batch is overwritten.
+		bool inPlace = _memoryIO && _inputMemory.overlaps(_outputMemory);
+
+		while (remainingClusters > 0)
+		{
+			std::size_t count = std::min(batchClusters, remainingClusters);
+			const Block * in = (const Block *)mappedInput(count*_clusterBytes);
+			if (inPlace)
+			{
+				inSlots[0].assign(in, in+count*clusterBlocks);
+				in = &inSlots[0][0];
+			}
+			runBatch(in, (Block *)mappedOutput(count*_clusterBytes), count);
+			remainingClusters -= count;
+		}
+		return;
+	}
+
+	// Streams and io_uring: the next batch is read and the previous one written while this one is worked on
+
+	// Scattered memory is gathered a batch at a time on this thread
+	if (_memoryIO)
+	{
+		while (remainingClusters > 0)
+		{
+			std::size_t count = std::min(batchClusters, remainingClusters);
+			inSlots[0].resize(count*clusterBlocks);
+			outSlots[0].resize(count*clusterBlocks);
+			if (readInput(&inSlots[0][0], count*_clusterBytes) != count*_clusterBytes)
+				throw std::runtime_error (encrypting ? "COULD NOT READ INPUT FILE" : "INPUT IS NOT A VALID ENCRYPTED FILE");
+
+			runBatch(&inSlots[0][0], &outSlots[0][0], count);
+			writeOutput(&outSlots[0][0], count*_clusterBytes);
+			remainingClusters -= count;
+		}
+		return;
+	}
+
+	if (_uring.inputOpen() && _uring.outputOpen())
+	{
+		// Full size slots, their buffers stay put while registered
+		std::vector<unsigned char *> inBuffers, outBuffers;
+		for (std::size_t slot = 0; slot < PIPELINE_SLOTS; slot++)
+		{
+			inSlots[slot].resize(batchClusters*clusterBlocks);
+			outSlots[slot].resize(batchClusters*clusterBlocks);
+			inBuffers.push_back(&inSlots[slot][0].data[0]);
+			outBuffers.push_back(&outSlots[slot][0].data[0]);
+		}
+
+		bool ran = _uring.run(inBuffers, outBuffers, batchClusters*_clusterBytes, _inputOffset, _outputOffset,
+							  [&] (std::size_t slot, std::size_t & bytes)
+		{
+			slotClusters[slot] = std::min(batchClusters, remainingClusters);
+			remainingClusters -= slotClusters[slot];
+			bytes = slotClusters[slot]*_clusterBytes;
+			return remainingClusters == 0;
+		},
+		[&] (std::size_t slot)
+		{
+			runBatch(&inSlots[slot][0], &outSlots[slot][0], slotClusters[slot]);
+			return slotClusters[slot]*_clusterBytes;
+		});
+
+		if (ran)
+			return;
+	}
+
+	ClusterPipeline pipeline (PIPELINE_SLOTS);
+
+	pipeline.run([&] (std::size_t slot)
+	{
+		std::size_t count = std::min(batchClusters, remainingClusters);
+		inSlots[slot].resize(count*clusterBlocks);
+		if (readInput(&inSlots[slot][0], count*_clusterBytes) != count*_clusterBytes)
+			throw std::runtime_error ("COULD NOT READ INPUT FILE");
+
+		slotClusters[slot] = count;
+		remainingClusters -= count;
+		return remainingClusters == 0;
+	},
+	[&] (std::size_t slot)
+	{
+		outSlots[slot].resize(slotClusters[slot]*clusterBlocks);
+		runBatch(&inSlots[slot][0], &outSlots[slot][0], slotClusters[slot]);
+	},
+	[&] (std::size_t slot)
+	{
+		writeOutput(&outSlots[slot][0], slotClusters[slot]*_clusterBytes);
+	});
 }
-// Performs a Feistel round for decryption
-void WilhelmCBC::roundDec()
+
+// Hashes and XEX encrypts count full clusters from plain to encrypted across pool, adds their hashes and moves past them
+void WilhelmCBC::encryptBatchXEX (const Block * plain, Block * encrypted, std::size_t count, WorkerPool & pool)
 {
-	*_currentR = *_currentR ^ feistel(*_currentL);
-	*_currentL = *_currentL ^ feistel(*_currentR);
+	const std::size_t clusterBlocks = _clusterBytes/BLOCK_BYTES;
+	std::vector<Block> & batchHashes = _arena.batchHashes;
+	batchHashes.resize(count);
+	// Clusters per task, as many as SHA256 hashes at once
+	const std::size_t hashGroup = std::min<std::size_t>(SHA256::lanes(), HASH_AHEAD_CLUSTERS);
+
+	// Each task hashes one group of clusters side by side, then encrypts them
+	std::size_t groups = (count+hashGroup-1)/hashGroup;
+	pool.parallelFor(groups, [&] (std::size_t group, unsigned int)
+	{
+		std::size_t first = group*hashGroup;
+		std::size_t groupCount = std::min(hashGroup, count-first);
+
+		Hash_SHA256_Clusters(&plain[first*clusterBlocks], clusterBlocks, groupCount, &batchHashes[first]);
+		for (std::size_t i = first; i < first+groupCount; i++)
+			CipherCore::encryptClusterXEX(_keySchedule, _clusterNum+i, _fileIV, &plain[i*clusterBlocks], &encrypted[i*clusterBlocks],
+										  _clusterBytes, _clusterBytes);
+	});
+
+	// The tree takes cluster hashes in order
+	for (std::size_t i = 0; i < count; i++)
+		addClusterHash(batchHashes[i]);
+
+	// Pick up where the serial loop would be
+	_lastBlockPrevCluster = encrypted[count*clusterBlocks-1];
+	_clusterNum += count;
+	_blockNum += count*(clusterBlocks-1);
+	_indexToStream += count*_clusterBytes;
 }
 
-// Performs Feistel manipulation to be ^='d with the opposing side.
-WilhelmCBC::LRSide WilhelmCBC::feistel (WilhelmCBC::LRSide baseDerivation)
+// Decrypts count full clusters from encrypted to decrypted across pool, adds their hashes and moves past them
+void WilhelmCBC::decryptBatch (const Block * encrypted, Block * decrypted, std::size_t count, WorkerPool & pool)
 {
-	/* Byte substitution table (stolen from Rijndael) */
-	unsigned char substitutionSingleChar[256] =
+	const std::size_t clusterBlocks = _clusterBytes/BLOCK_BYTES;
+	std::vector<Block> & batchHashes = _arena.batchHashes;
+	batchHashes.resize(count);
+	// Clusters per task, as many as SHA256 hashes at once
+	const std::size_t hashGroup = std::min<std::size_t>(SHA256::lanes(), HASH_AHEAD_CLUSTERS);
+
+	// Each task decrypts one group of clusters, then hashes the group side by side
+	std::size_t groups = (count+hashGroup-1)/hashGroup;
+	pool.parallelFor(groups, [&] (std::size_t group, unsigned int)
 	{
-		0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
-		0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
-		0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
-		0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
-		0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
-		0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
-		0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
-		0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
-		0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
-		0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
-		0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
-		0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
-		0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
-		0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
-		0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
-		0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
-	};
+		std::size_t first = group*hashGroup;
+		std::size_t groupCount = std::min(hashGroup, count-first);
 
-	baseDerivation = baseDerivation ^ permutationKey (_baseKey, _roundNum, _blockNum);
+		for (std::size_t i = first; i < first+groupCount; i++)
+		{
+			const Block * in = &encrypted[i*clusterBlocks];
+			Block * out = &decrypted[i*clusterBlocks];
+
+			Block chain = i ? in[-1] : _lastBlockPrevCluster;
+			if (_fileMode == MODE_XEX)
+				CipherCore::decryptClusterXEX(_keySchedule, _clusterNum+i, _fileIV, in, out, _clusterBytes, _clusterBytes);
+			else
+				CipherCore::decryptCluster(_keySchedule, _clusterNum+i, in, out, _clusterBytes, _clusterBytes, chain);
+		}
+		Hash_SHA256_Clusters(&decrypted[first*clusterBlocks], clusterBlocks, groupCount, &batchHashes[first]);
+	});
+
+	// The tree takes cluster hashes in order
+	for (std::size_t i = 0; i < count; i++)
+		addClusterHash(batchHashes[i]);
+
+	// Pick up where the serial loop would be
+	_lastBlockPrevCluster = encrypted[count*clusterBlocks-1];
+	_clusterNum += count;
+	_blockNum += count*(clusterBlocks-1);
+	_indexToStream += count*_clusterBytes;
+}
+
+/**** Input and Output ****/
+
+// Reads up to bytes from the input mapping or stream. Returns the number of bytes read.
+std::size_t WilhelmCBC::readInput (void * destination, std::size_t bytes)
+{
+	std::size_t mappedBytes;
+	if (inputMapping(mappedBytes))
+	{
+		bytes = std::min(bytes, mappedBytes-_inputOffset);
+		memcpy(destination, mappedInput(bytes), bytes);
+		return bytes;
+	}
+	if (_memoryIO)
+	{
+		bytes = _inputMemory.copy(_inputOffset, destination, bytes, false);
+		_inputOffset += bytes;
+		return bytes;
+	}
+	if (_uring.inputOpen())
+	{
+		bytes = _uring.read(destination, bytes, _inputOffset);
+		_inputOffset += bytes;
+		return bytes;
+	}
+	if (_streamingInput)
+	{
+		// Whatever findInputEnd read ahead comes first
+		std::size_t buffered = std::min(bytes, _lookahead.size()-_lookaheadStart);
+		if (buffered)
+			memcpy(destination, &_lookahead[_lookaheadStart], buffered);
+		_lookaheadStart += buffered;
 
-		for (unsigned int subCounter = 0; subCounter < BLOCK_BYTES/2; subCounter++)
+		if (buffered < bytes)
 		{
-			baseDerivation.data[subCounter] = substitutionSingleChar[baseDerivation.data[subCounter]];
+			_ifile.read((char*)destination+buffered, bytes-buffered);
+			buffered += (std::size_t)_ifile.gcount();
 		}
+		_inputOffset += buffered;
+		return buffered;
+	}
+
+	_ifile.read((char*)destination, bytes);
+	return (std::size_t)_ifile.gcount();
+}
 
-		// _roundNum has maximum value of 16, so 16+27 is < 64, which is the range of values for which rorLRSide behaviors reasonably.
-		// In debugging I noticed a very strange convergence that happens with most vlaues of ROR_CONSTANT when _roundNum is held constant, where repeated
-		//	runs of feistel function with the same input would converge to a single value. _roundNum changes every run so it's not significant.
+// Streaming input only. Reads ahead until more than bytes past stream position index (where the input is now) are buffered.
+// Returns false if there are, or true with inputSize set to where the input ends, if it ends before that.
+bool WilhelmCBC::findInputEnd (std::size_t index, std::size_t bytes, std::size_t & inputSize)
+{
+	// Drop what readInput already took
+	_lookahead.erase(_lookahead.begin(), _lookahead.begin()+_lookaheadStart);
+	_lookaheadStart = 0;
+
+	std::size_t buffered = _lookahead.size();
+	if (buffered <= bytes && _ifile.good())
+	{
+		_lookahead.resize(bytes+1);
+		_ifile.read((char*)&_lookahead[buffered], bytes+1-buffered);
+		buffered += (std::size_t)_ifile.gcount();
+		_lookahead.resize(buffered);
+	}
 
-		baseDerivation = rorLRSide(baseDerivation, ROR_CONSTANT+_roundNum);
+	if (buffered > bytes)
+		return false;
 
-	return baseDerivation;
+	inputSize = index+buffered;
+	return true;
 }
 
-// Creates a LRBlock for use as a round key
-WilhelmCBC::LRSide WilhelmCBC::permutationKey (WilhelmCBC::Block key, unsigned long round, unsigned long blockNum)
+// Writes to the output mapping or stream
+void WilhelmCBC::writeOutput (const void * source, std::size_t bytes)
 {
-	// Split the base key
-	LRSide keyHalf1 = *(LRSide*)&key.data[0];
-	LRSide keyHalf2 = *(((LRSide*)&key.data[0])+1);
+	std::size_t mappedBytes;
+	if (outputMapping(mappedBytes))
+		memcpy(mappedOutput(bytes), source, bytes);
+	else if (_memoryIO)
+	{
+		if (_outputMemory.copy(_outputOffset, const_cast<void *>(source), bytes, true) != bytes)
+			throw std::runtime_error ("OUTPUT BUFFER IS TOO SMALL");
+		_outputOffset += bytes;
+	}
+	else if (_uring.outputOpen())
+	{
+		if (!_uring.write(source, bytes, _outputOffset))
+			throw std::runtime_error ("COULD NOT WRITE OUTPUT FILE");
+		_outputOffset += bytes;
+	}
+	else
+	{
+		_ofile.write((const char*)source, bytes);
+		_outputOffset += bytes;
+	}
+}
 
-	LRSide roundKey = (rorLRSide(keyHalf1, (_clusterNum+ROR_CONSTANT+3)%(BLOCK_BITS/2)))
-						^(rorLRSide(keyHalf2, (_blockNum+ROR_CONSTANT+7)%(BLOCK_BITS/2)));
-	roundKey = rorLRSide (roundKey, (_roundNum*4+ROR_CONSTANT+13)%(BLOCK_BITS/2));
+// Moves the input to byte position, counted from the start of the input
+void WilhelmCBC::seekInput (std::size_t position)
+{
+	if (_streamingInput)
+		throw std::runtime_error ("INPUT CANNOT SEEK");
 
-	return roundKey;
-	/*
-	// Generate permutation key from Block key
-	key.data[0]+=blockNum;
-	Hash_SHA256_Block(key);
-	key.data[0]+=round;
-	Hash_SHA256_Block(key);
+	_inputOffset = position;
+	if (_ifile.is_open())
+	{
+		_ifile.clear();
+		_ifile.seekg(position);
+	}
+}
 
-	uint64_t * LRKeyPtr1;
+// Returns the next bytes of the input mapping, and moves past them
+const unsigned char * WilhelmCBC::mappedInput (std::size_t bytes)
+{
+	std::size_t mappedBytes;
+	const unsigned char * data = inputMapping(mappedBytes)+_inputOffset;
+	if (_inputOffset + bytes > mappedBytes)
+		throw std::runtime_error ("INPUT IS NOT A VALID ENCRYPTED FILE");
+
+	_inputOffset += bytes;
+	return data;
+}
 
-	// XOR the first 128 bits with the second 128 bits.
-	LRKeyPtr1 = (uint64_t*)(&key.data[0]);
-	LRKeyPtr1[0] = LRKeyPtr1[0]^LRKeyPtr1[2];
-	LRKeyPtr1[1] = LRKeyPtr1[1]^LRKeyPtr1[3];
+// Returns space for the next bytes of the output mapping, and moves past it
+unsigned char * WilhelmCBC::mappedOutput (std::size_t bytes)
+{
+	std::size_t mappedBytes;
+	unsigned char * data = outputMapping(mappedBytes)+_outputOffset;
+	if (_outputOffset + bytes > mappedBytes)
+		throw std::runtime_error (_memoryIO ? "OUTPUT BUFFER IS TOO SMALL" : "OUTPUT IS LARGER THAN EXPECTED");
 
-	// return our LRSide key
-	return *((LRSide*)LRKeyPtr1);
-	 */
+	_outputOffset += bytes;
+	return data;
 }
 
-// Right Circulular bit shifts an LRSide
-WilhelmCBC::LRSide WilhelmCBC::rorLRSide (const WilhelmCBC::LRSide & input, unsigned long rotateCount)
+// The whole input as one range of memory, a mapped file or a single caller buffer, and its size. NULL for anything else.
+const unsigned char * WilhelmCBC::inputMapping (std::size_t & size) const
 {
-	LRSide result;
-	uint64_t * inputPtr = (uint64_t*)&input.data[0];
-	uint64_t * resultPtr = (uint64_t*)&result.data[0];
+	size = 0;
+	if (_inputMap.isOpen())
+	{
+		size = _inputMap.size();
+		return _inputMap.data();
+	}
+	if (_memoryIO && _inputMemory.ranges.size() == 1)
+	{
+		size = _inputMemory.size;
+		return (const unsigned char *)_inputMemory.ranges[0].iov_base;
+	}
+	return NULL;
+}
 
-	for (unsigned int i = 0; i < 2; i++)
-		resultPtr[i] = (inputPtr[i]>>rotateCount) | (inputPtr[(i+1)%2]<<(64-rotateCount));
+// The whole output as one range of memory, see inputMapping
+unsigned char * WilhelmCBC::outputMapping (std::size_t & size) const
+{
+	size = 0;
+	if (_outputMap.isOpen())
+	{
+		size = _outputMap.size();
+		return _outputMap.data();
+	}
+	if (_memoryIO && _outputMemory.ranges.size() == 1)
+	{
+		size = _outputMemory.size;
+		return (unsigned char *)_outputMemory.ranges[0].iov_base;
+	}
+	return NULL;
+}
 
-	return result;
+// Takes caller memory in place of the input and output files, and starts a new file like setInput
+void WilhelmCBC::setMemory (const struct iovec * input, std::size_t inputCount, const struct iovec * output, std::size_t outputCount)
+{
+	_indexToStream = 0;
+	_blockNum = 0;
+	_clusterNum = 0;
+	_lastCluster = false;
+	_currentBlockSet.clear();
+
+	_ifile.close();
+	_ofile.close();
+	_inputMap.close();
+	_outputMap.close();
+	_uring.closeInput();
+	_uring.closeOutput();
+	_streamingInput = false;
+
+	_memoryIO = true;
+	_inputMemory.assign(input, inputCount);
+	_outputMemory.assign(output, outputCount);
+	_inputSize = _inputMemory.size;
+	_inputOffset = 0;
+	_outputOffset = 0;
+}
+
+// Keeps the non empty ranges, and rewinds
+void WilhelmCBC::MemoryRanges::assign (const struct iovec * vecs, std::size_t count)
+{
+	ranges.clear();
+	size = 0;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (vecs[i].iov_len == 0)
+			continue;
+		ranges.push_back(vecs[i]);
+		size += vecs[i].iov_len;
+	}
+	index = 0;
+	start = 0;
+}
+
+// Copies up to bytes between buffer and the ranges, starting offset bytes into them. Returns the bytes copied.
+// Offsets only move forward between calls, so the search picks up from the range last used.
+std::size_t WilhelmCBC::MemoryRanges::copy (std::size_t offset, void * buffer, std::size_t bytes, bool toRanges)
+{
+	if (offset < start)
+	{
+		index = 0;
+		start = 0;
+	}
+
+	std::size_t copied = 0;
+	while (copied < bytes && index < ranges.size())
+	{
+		std::size_t rangeOffset = offset + copied - start;
+		if (rangeOffset >= ranges[index].iov_len)
+		{
+			start += ranges[index].iov_len;
+			index++;
+			continue;
+		}
+
+		std::size_t n = std::min(bytes-copied, ranges[index].iov_len-rangeOffset);
+		unsigned char * range = (unsigned char *)ranges[index].iov_base + rangeOffset;
+		if (toRanges)
+			memcpy(range, (const unsigned char *)buffer + copied, n);
+		else
+			memcpy((unsigned char *)buffer + copied, range, n);
+		copied += n;
+	}
+
+	return copied;
+}
+
+// Whether any byte of these ranges is also in other
+bool WilhelmCBC::MemoryRanges::overlaps (const MemoryRanges & other) const
+{
+	for (std::size_t i = 0; i < ranges.size(); i++)
+		for (std::size_t j = 0; j < other.ranges.size(); j++)
+		{
+			const unsigned char * a = (const unsigned char *)ranges[i].iov_base;
+			const unsigned char * b = (const unsigned char *)other.ranges[j].iov_base;
+			if (a < b+other.ranges[j].iov_len && b < a+ranges[i].iov_len)
+				return true;
+		}
+	return false;
+}
+
+// Maps the output file if the input is mapped, trading the stream for a pre-sized mapping of maxSize bytes
+void WilhelmCBC::mapOutput (std::size_t maxSize)
+{
+	_outputOffset = 0;
+
+	if (_inputMap.isOpen() && _outputMap.openWrite(_outputName, maxSize))
+		_ofile.close();
+}
+
+// Trims a mapped output to what was written
+void WilhelmCBC::closeOutput ()
+{
+	if (_outputMap.isOpen() && !_outputMap.close(_outputOffset))
+		throw std::runtime_error ("COULD NOT WRITE OUTPUT FILE");
+	_uring.closeOutput();
+
+	// Flushes the stream, so write errors show up here
+	if (_ofile.is_open())
+	{
+		_ofile.close();
+		if (_ofile.fail())
+			throw std::runtime_error ("COULD NOT WRITE OUTPUT FILE");
+	}
 }
 
 // Creates a random block
 WilhelmCBC::Block WilhelmCBC::IVGenerator ()
 {
-	// Build IV from system random data;
+	// Build IV from the thread's random pool, seeded from system random data
 	Block b;
-	std::ifstream random;
-	random.open ("/dev/random", std::ios::in | std::ios::binary);
-	random.read((char*)&b.data[0],BLOCK_BYTES);
-	random.close();
+	RandomPool::fill(&b.data[0],BLOCK_BYTES);
 
 	// Hash random data multiple times
 	for (unsigned int i = 0; i < HASHING_REPEATS; i++)
@@ -513,6 +1670,12 @@ WilhelmCBC::Block WilhelmCBC::Padding (WilhelmCBC::Block b)
 	return paddingCounted;
 }
 
+// Cluster sizes are whole multiples of MIN_CLUSTER_BYTES, up to MAX_CLUSTER_BYTES
+bool WilhelmCBC::validClusterSize (std::size_t clusterBytes)
+{
+	return clusterBytes >= MIN_CLUSTER_BYTES && clusterBytes <= MAX_CLUSTER_BYTES && clusterBytes%MIN_CLUSTER_BYTES == 0;
+}
+
 // Hash 1 block with SHA256. Writes directly to parameter block.
 void WilhelmCBC::Hash_SHA256_Block (WilhelmCBC::Block & b)
 {
@@ -526,81 +1689,92 @@ void WilhelmCBC::Hash_SHA256_Block (WilhelmCBC::Block & b)
 	}
 }
 
-// Hashes _currentBlockSet and returns a block containing the hash
-WilhelmCBC::Block WilhelmCBC::Hash_SHA256_Current_Cluster ()
+// Feeds the hash of the next cluster into the integrity tree
+void WilhelmCBC::addClusterHash (const WilhelmCBC::Block & clusterHash)
 {
-	SHA256 hash;
-	hash.add((char*)&_currentBlockSet[0],_currentBlockSet.size()*BLOCK_BYTES);
-	SHA256::digest d = hash.finish();
+	SHA256::digest leaf;
+	memcpy(&leaf.data[0], &clusterHash.data[0], BLOCK_BYTES);
+	_clusterHashes.add(leaf);
 
-	Block b;
-	
-	for (unsigned int i = 0; i < BLOCK_BYTES; i++)
+	if (_collectDigests)
 	{
-		b.data[i] = d.data[i];
+		_clusterDigests.push_back(clusterDigest(clusterHash));
+		if (_clusterDigests.size() == INDEX_SPOOL_ENTRIES)
+			spoolIndexEntries();
 	}
-
-	return b;
 }
 
-/**** Overloaded Operators ****/
+// Keyed digest of a cluster for the footer index, the hash of the key and the cluster's hash.
+// Keyed, so the index neither gives away the hashes of the plaintext nor can be rewritten to match other plaintext.
+WilhelmCBC::Block WilhelmCBC::clusterDigest (const Block & clusterHash) const
+{
+	Block message[2] = {_baseKey, clusterHash};
+	return Hash_SHA256_Blocks(message, 2);
+}
 
-// Block addition operator
-WilhelmCBC::Block & WilhelmCBC::Block::operator+= (const WilhelmCBC::Block &rhs)
+// Returns the root of the integrity tree over every cluster hash, and resets it
+WilhelmCBC::Block WilhelmCBC::finishClusterHashes ()
 {
-	// Addition, done in 64bit blocks - no carry between 64bit blocks.
-	// Not true addition, but sufficient for key permutation
-	uint64_t * dataPtr = (uint64_t*)&data[0];
-	const uint64_t * rhsDataPtr = (uint64_t*)&rhs.data[0];
-	
-	for (unsigned int i = 0; i < BLOCK_BYTES/8; i++)
-	{
-			dataPtr[i] += rhsDataPtr[i];
-	}
+	SHA256::digest root = _clusterHashes.finish();
 
-	return *this;
+	Block b;
+	memcpy(&b.data[0], &root.data[0], BLOCK_BYTES);
+	return b;
 }
 
-// Block addition operator
-bool WilhelmCBC::Block::operator== (const WilhelmCBC::Block &rhs) const
+// Hashes _currentBlockSet and returns a block containing the hash
+WilhelmCBC::Block WilhelmCBC::Hash_SHA256_Current_Cluster ()
 {
-	// Addition, done in 64bit blocks - no carry between 64bit blocks.
-	// Not true addition, but sufficient for key permutation
-	uint64_t * dataPtr = (uint64_t*)&data[0];
-	const uint64_t * rhsDataPtr = (uint64_t*)&rhs.data[0];
+	return Hash_SHA256_Blocks(&_currentBlockSet[0], _currentBlockSet.size());
+}
 
-	for (unsigned int i = 0; i < BLOCK_BYTES/8; i++)
+// Hashes blockCount blocks and returns a block containing the hash
+WilhelmCBC::Block WilhelmCBC::Hash_SHA256_Blocks (const WilhelmCBC::Block * blocks, std::size_t blockCount)
+{
+	SHA256 hash;
+	hash.add((const char*)blocks,blockCount*BLOCK_BYTES);
+	SHA256::digest d = hash.finish();
+
+	Block b;
+	
+	for (unsigned int i = 0; i < BLOCK_BYTES; i++)
 	{
-		if (!(dataPtr[i] == rhsDataPtr[i]))
-			return false;
+		b.data[i] = d.data[i];
 	}
 
-	return true;
+	return b;
 }
 
-// Block xor operator
-WilhelmCBC::Block WilhelmCBC::Block::operator^ (const WilhelmCBC::Block & rhs) const
+// Hashes count messages of messageBytes each into hashes, SHA256::lanes() of them at once
+void WilhelmCBC::Hash_SHA256_Many (const void * const * messages, std::size_t messageBytes, std::size_t count, WilhelmCBC::Block * hashes)
 {
-	Block result;
-	for (unsigned int i = 0; i < (BLOCK_BYTES); i+=(BLOCK_BYTES/4)) // 4 bytes in a uint64_t, so divide by 4
+	SHA256::digest digests[HASH_AHEAD_CLUSTERS];
+
+	for (std::size_t first = 0; first < count; first += HASH_AHEAD_CLUSTERS)
 	{
-		*((uint64_t*)&result.data[i]) = *((uint64_t*)&data[i])^*((uint64_t*)&rhs.data[i]);
+		std::size_t n = std::min<std::size_t>(count-first, HASH_AHEAD_CLUSTERS);
+		SHA256::addMany(&messages[first], messageBytes, n, digests);
+
+		for (std::size_t i = 0; i < n; i++)
+			memcpy(&hashes[first+i].data[0], &digests[i].data[0], BLOCK_BYTES);
 	}
-	return result;
 }
 
-// LRSide xor operator
-WilhelmCBC::LRSide WilhelmCBC::LRSide::operator^ (const WilhelmCBC::LRSide & rhs) const
+// Hashes count consecutive clusters of clusterBlocks blocks each, one hash per cluster
+void WilhelmCBC::Hash_SHA256_Clusters (const WilhelmCBC::Block * clusters, std::size_t clusterBlocks, std::size_t count, WilhelmCBC::Block * hashes)
 {
-	LRSide result;
-	for (unsigned int i = 0; i < (BLOCK_BYTES/2); i+=(BLOCK_BYTES/4)) // 4 bytes in a uint64_t, so divide by 4
+	const void * messages[HASH_AHEAD_CLUSTERS];
+
+	for (std::size_t first = 0; first < count; first += HASH_AHEAD_CLUSTERS)
 	{
-		*((uint64_t*)&result.data[i]) = *((uint64_t*)&data[i])^*((uint64_t*)&rhs.data[i]);
+		std::size_t n = std::min<std::size_t>(count-first, HASH_AHEAD_CLUSTERS);
+		for (std::size_t i = 0; i < n; i++)
+			messages[i] = &clusters[(first+i)*clusterBlocks];
+
+		Hash_SHA256_Many(messages, clusterBlocks*BLOCK_BYTES, n, &hashes[first]);
 	}
-	return result;
 }
 
-
 /****  Debugging ****/
 
 void	WilhelmCBC::printBlock (const WilhelmCBC::Block & b) const
@@ -23,18 +23,75 @@
  
 	encrypt();
 		->	encCBC();
-			-> blockEnc();
-				-> roundEnc();
+			-> CipherCore::encryptBlocks();
+		->	encryptBatchXEX();	// setCipherMode(MODE_XEX)
+			-> CipherCore::encryptClusterXEX();
+
+	encryptBatch(jobs);	// Many files, up to ENCRYPT_LANES at a time
+		->	encCBCInterleaved();
+			-> CipherCore::blockEncLanes();
  
 	decrypt();
 		 ->	decCBC();
-			 -> blockDec();
-				 -> roundDec();
+			 -> CipherCore::decryptBlocks();
+
+	decryptRange(offset, length);	// Only the clusters holding those plaintext bytes
+		 ->	decryptBatch();
+			 -> CipherCore::decryptCluster();
 	********************************
+
+	The cipher itself is CipherCore, which holds no state. WilhelmCBC adds the file format and IO on top,
+	and keeps the position in the file being worked on, so one object handles one file at a time.
+
+	decrypt() has no serial dependency between clusters, so all but the last cluster are decrypted and hashed
+	in batches across a WorkerPool of setThreads() threads (all hardware threads by default).
+	setCipherMode(MODE_XEX) encrypts with CipherCore's XEX mode instead of CBC, where clusters do not chain either,
+	so encrypt() runs its clusters in the same batches. CBC stays the default, the mode used is kept in the header.
+	decryptRange() decrypts only the clusters holding a range of plaintext bytes, seeking past the rest of the input.
+	The file hash covers every cluster, so a range is not checked against it.
 	
 	setInput or setOutput may throw. Client code should check for errors. Exceptions documented in definitions.
 
+	Regular files are memory mapped, and full clusters are encrypted and decrypted straight between the mapped pages.
+	Anything that cannot be mapped (pipes, devices) goes through the ifstream/ofstream, with a ClusterPipeline
+	reading ahead and writing behind on their own threads while the calling thread encrypts or decrypts.
+	Input that cannot seek (setInput ("/dev/stdin") on a pipe) is streamed: its length is unknown, so each cluster
+	is only encrypted or decrypted once the input has been read one cluster past it, which tells whether it is the last.
+	Output is written as it goes, so stdin to stdout needs no temporary files.
+
+	encryptBuffer and decryptBuffer do the same between memory ranges, one (pointer, size) or a list of iovecs
+	each way, in the same format as the files. A single range each way is worked on in place, like a mapped file.
+	decryptBuffer may be given the same memory for input and output. encryptBuffer writes ahead of what it reads,
+	so it throws if they overlap.
+
+	Cluster and batch buffers come from an arena kept with the object, so after the first file they are not allocated again.
+
+	setIOBackend(IO_URING) reads and writes regular files through Linux io_uring instead, with reads submitted ahead and
+	writes behind from the calling thread. Where io_uring is not available the streams are used.
+
 	encrypt() or decrypt() may throw if set functions are not called first.
+	The key is derived once by setKey, after which one object can encrypt or decrypt any number of files in turn
+	(setInput, setOutput, encrypt() or decrypt() for each).
+
+	File layout:
+	********************************
+	Header		1 Block: "WilhCBC\0", FILE_VERSION, integrity mode (setIntegrityMode), algorithm (setCipherMode), flags,
+					cluster size (setClusterSize) as 4 bytes little endian
+	IV			1 Block
+	Clusters	Cluster size each, the last one followed by the padding block
+	Hash		1 Block, HashTree root over the hashes of each plaintext cluster
+	Index		Only with HEADER_FLAG_INDEX (setIndex), each block 8 bytes little endian then the rest:
+		1 Block: "WilhIDX\0", number of clusters
+		1 Block per cluster: file offset of the cluster, INDEX_DIGEST_BYTES of its keyed plaintext digest
+		1 Block: the first block again, so the index is found from the end of the file
+	********************************
+	Files written before the header was added start with the IV, use CLUSTER_BYTES clusters and a FLAT hash.
+	Version 1 files have no algorithm, flags or index. decrypt() reads them all.
+
+	The index lets decryptRange() check the clusters it decrypts without the rest of the file, and tools find any
+	cluster without reading the ones before it. decrypt() relies on the hash alone. Encrypting with an index keeps
+	at most INDEX_SPOOL_ENTRIES entries in memory, the rest wait in an unnamed temporary file (tmpfile) until the footer
+	is written, a Block per cluster, so disk rather than memory grows with the file.
 */
 
 
@@ -46,30 +103,78 @@
 #include <string>		// std::string
 #include <fstream>		// file IO
 #include <vector>		// std::vector
+#include <memory>		// std::unique_ptr
+#include <cstdio>		// std::FILE, index spool
 #include <stdint.h>		// uint64_t
+#include <sys/uio.h>	// struct iovec
 
 #include "SHA256.h"		// Public Domain SHA256 hash function
+#include "CipherCore.h"	// Block cipher and CBC chaining
+#include "WorkerPool.h"	// Threads for parallel encryption and decryption
+#include "MappedFile.h"	// mmap backend for regular files
+#include "HashTree.h"	// Streaming hash of cluster hashes
+#include "RandomPool.h"	// IV and padding randomness
+#include "ClusterPipeline.h"	// Overlapped stream IO
+#include "UringIO.h"	// io_uring backend for regular files
 
 // GLOBAL CONST
 
-const unsigned int CLUSTER_BYTES	= 4096;
-const unsigned int BLOCK_BYTES		= 32;
-const unsigned int BLOCK_BITS		= 256;
+const unsigned int CLUSTER_BYTES	= 4096;		// Default cluster size, and the size used by files without a header
+const unsigned int MIN_CLUSTER_BYTES	= 4096;
+const unsigned int MAX_CLUSTER_BYTES	= 16*1024*1024;
+const unsigned int FILE_VERSION		= 2;	// Version 2 added the algorithm and flags header bytes, and the footer index
+const unsigned int HEADER_FLAG_INDEX	= 1;	// Header flags bit, the file ends in a footer index
+const unsigned int INDEX_DIGEST_BYTES	= 24;	// Bytes of each cluster's keyed digest kept in its index entry
+const unsigned int INDEX_SPOOL_ENTRIES	= 4096;	// Index entries kept in memory while encrypting, more are spooled to a temporary file
 const unsigned int HASHING_REPEATS	= 2;
-const unsigned int ROR_CONSTANT		= 27;
-const unsigned int FEISTEL_ROUNDS	= 16;
+const unsigned int PARALLEL_BATCH_BYTES	= 256*1024;	// Bytes per thread read in per parallel batch
+const unsigned int ENCRYPT_LANES	= 8;	// Files encrypted in lockstep by encryptBatch
+const unsigned int PIPELINE_SLOTS	= 4;	// Clusters (or decryption batches) in flight between the reader, crypto and writer stages
+const std::size_t STREAM_SIZE_UNKNOWN	= ((std::size_t)-1/2) & ~(std::size_t)31;	// _inputSize of streaming input until its end is found, a multiple of BLOCK_BYTES
+const unsigned int HASH_AHEAD_CLUSTERS	= 16;	// Full clusters hashed together by SHA256::addMany, one per vector lane
 
 class WilhelmCBC {
 public:
+// Public Types
+	// EncryptJob, one file for encryptBatch.
+	struct EncryptJob {
+		std::string input;
+		std::string output;
+		std::string password;
+	};
+
+	// IOBackend, how setInput and setOutput read and write regular files.
+	enum IOBackend {IO_MAPPED = 0, IO_URING = 1, IO_STREAM = 2};
+
+	// CipherMode, how blocks are chained. Stored as the header algorithm byte.
+	enum CipherMode {MODE_CBC = 0, MODE_XEX = 1};
+
 // Public Methods
+	void setIOBackend (IOBackend backend);
 	void setInput (std::string filename);
 	void setOutput (std::string filename);
 	void setKey (std::string password);
+	void setClusterSize (std::size_t clusterBytes);
+	void setIntegrityMode (HashTree::Mode mode);
+	void setCipherMode (CipherMode mode);
+	void setIndex (bool index);
+	void setThreads (unsigned int threads);
 	void encrypt ();
 	bool decrypt ();
+	std::size_t decryptRange (std::size_t offset, std::size_t length);
+
+	static void encryptBatch (const std::vector<EncryptJob> & jobs, std::size_t clusterBytes = CLUSTER_BYTES);
 
 	std::size_t getSize();
 
+	std::size_t encryptBuffer (const void * input, std::size_t inputBytes, void * output, std::size_t outputBytes);
+	std::size_t encryptBuffer (const struct iovec * input, std::size_t inputCount, const struct iovec * output, std::size_t outputCount);
+	bool decryptBuffer (const void * input, std::size_t inputBytes, void * output, std::size_t outputBytes, std::size_t & plainBytes);
+	bool decryptBuffer (const struct iovec * input, std::size_t inputCount, const struct iovec * output, std::size_t outputCount,
+						std::size_t & plainBytes);
+
+	static std::size_t encryptedSize (std::size_t plainBytes, bool index = false, std::size_t clusterBytes = CLUSTER_BYTES);
+
 // Debugging
 	void publicDebugFunc();
 
@@ -78,49 +183,115 @@ public:
 	{
 		_indexToStream = 0;
 		_blockNum = 0;
-		_roundNum = 0;
 		_clusterNum = 0;
 		_inputSize = 0;
-		_currentBlock = NULL;
-		_currentL = NULL;
-		_currentR = NULL;
-		std::vector<char> _currentBlockSet;
+		_inputOffset = 0;
+		_outputOffset = 0;
+		_lastCluster = false;
+		_clusterBytes = CLUSTER_BYTES;
+		_integrityMode = HashTree::MERKLE;
+		_cipherMode = MODE_CBC;
+		_fileMode = MODE_CBC;
+		_threads = WorkerPool::defaultThreads();
+		_ioBackend = IO_MAPPED;
+		_streamingInput = false;
+		_lookaheadStart = 0;
+		_memoryIO = false;
+		_writeIndex = false;
+		_inputIndexed = false;
+		_indexClusters = 0;
+		_collectDigests = false;
+		_spooledEntries = 0;
 	}
 
 
 private:
 // Types
-	// Block, used for referencing 1 Block of data.
-	struct Block {
-		unsigned char data[BLOCK_BYTES];
-		Block & operator+= (const Block &rhs);
-		bool    operator== (const Block &rhs) const;
-		Block   operator^  (const Block &rhs) const;
+	typedef CipherCore::Block		Block;
+	typedef CipherCore::LRSide		LRSide;
+	typedef CipherCore::KeySchedule	KeySchedule;
+
+	// MemoryRanges, caller buffers read or written front to back as if they were one file
+	struct MemoryRanges {
+		std::vector<struct iovec>	ranges;
+		std::size_t					size;	// Bytes over all ranges
+		std::size_t					index;	// Range last copied to or from
+		std::size_t					start;	// Offset ranges[index] starts at
+		void		assign (const struct iovec *, std::size_t);
+		std::size_t	copy (std::size_t, void *, std::size_t, bool);
+		bool		overlaps (const MemoryRanges &) const;
 	};
 
-	// LRSide, used for referencing 1 side in a feistel process.
-	struct LRSide {
-		unsigned char data[BLOCK_BYTES/2];
-		LRSide operator^ (const LRSide & rhs) const;
+	// ClusterArena, cluster and batch buffers kept for the life of the object, so later clusters and files reuse them.
+	// They only ever grow, and resizing within capacity allocates nothing.
+	struct ClusterArena {
+		std::vector<Block>	inputSlots[PIPELINE_SLOTS];		// Plaintext clusters being encrypted, or encrypted batches being decrypted
+		std::vector<Block>	outputSlots[PIPELINE_SLOTS];	// Decrypted batches
+		std::vector<Block>	batchHashes;					// Cluster hashes of the batch decryptBatch or encryptBatchXEX is on
+		std::vector<Block>	indexEntries;					// Footer index entries of the clusters decryptRange is on
+	};
+
+	// FileCloser, closes the index spool
+	struct FileCloser {
+		void operator() (std::FILE * file) const { std::fclose(file); }
 	};
 
 private:
 // Private Methods
+	void  beginEncrypt();
+	void  writeHeader();
+	void  beginDecrypt(std::size_t);
+	void  readHeaderAndIV();
+	void  readIndexTrailer();
+	bool  findIndexStart();
+	void  writeIndex();
+	void  makeIndexEntries();
+	void  spoolIndexEntries();
+	void  readIndexEntries(std::size_t, std::size_t, std::size_t, std::vector<Block> &);
+	bool  indexEntryMatches(const Block &, std::size_t, const Block &) const;
+	static Block		indexBlock (std::size_t);
+	static std::size_t	indexFooterBytes (std::size_t);
+	void  readPlainCluster();
+	bool  readPlainCluster(std::vector<Block> &, std::size_t, std::size_t &);
+	bool  plainClusterSize(std::size_t, std::size_t, std::vector<Block> &, std::size_t &) const;
+	void  writeCipherCluster();
+	std::size_t cipherClusterBytes() const;
+	bool  encryptUring();
+	void  encryptPipelined();
+	void  finishEncrypt();
+	void  encryptMappedClusters(std::size_t);
 	void  encCBC();
+	static void encCBCInterleaved (WilhelmCBC * const *, std::size_t);
 	Block decCBC();
-	void blockEnc();
-	void blockDec();
-	void roundEnc();
-	void roundDec();
+	void  decryptClusterBlocks (Block *, std::size_t);
+	void  cryptClustersParallel (bool);
+	void  decryptBatch (const Block *, Block *, std::size_t, WorkerPool &);
+	void  encryptBatchXEX (const Block *, Block *, std::size_t, WorkerPool &);
+
+	std::size_t	readInput (void *, std::size_t);
+	bool		findInputEnd (std::size_t, std::size_t, std::size_t &);
+	void		writeOutput (const void *, std::size_t);
+	void		seekInput (std::size_t);
+	const unsigned char *	mappedInput (std::size_t);
+	unsigned char *			mappedOutput (std::size_t);
+	const unsigned char *	inputMapping (std::size_t &) const;
+	unsigned char *			outputMapping (std::size_t &) const;
+	void		setMemory (const struct iovec *, std::size_t, const struct iovec *, std::size_t);
+	void		mapOutput (std::size_t);
+	void		closeOutput ();
 
-	LRSide	feistel (LRSide);
-	LRSide	permutationKey (Block, unsigned long, unsigned long);
 	Block	IVGenerator ();
 	Block	Padding (Block);
+	static bool	validClusterSize (std::size_t);
 	void	Hash_SHA256_Block (Block &);
 	Block	Hash_SHA256_Current_Cluster ();
+	void	addClusterHash (const Block &);
+	Block	clusterDigest (const Block &) const;
+	Block	finishClusterHashes ();
 
-	LRSide	rorLRSide (const LRSide &, unsigned long);
+	static Block	Hash_SHA256_Blocks (const Block *, std::size_t);
+	static void		Hash_SHA256_Many (const void * const *, std::size_t, std::size_t, Block *);
+	static void		Hash_SHA256_Clusters (const Block *, std::size_t, std::size_t, Block *);
 
 // Debugging Methods
 	void	printBlock (const Block &) const;
@@ -129,17 +300,43 @@ private:
 // Private Data Members
 	std::ifstream	_ifile;
 	std::ofstream	_ofile;
+	std::string		_outputName;
+	MappedFile		_inputMap;
+	MappedFile		_outputMap;
+	UringIO			_uring;
+	IOBackend		_ioBackend;
+	bool			_streamingInput;
+	std::vector<unsigned char> _lookahead;	// Streaming input read ahead by findInputEnd
+	std::size_t		_lookaheadStart;
+	bool			_memoryIO;		// encryptBuffer or decryptBuffer, in place of files
+	MemoryRanges	_inputMemory;
+	MemoryRanges	_outputMemory;
+	std::size_t		_inputOffset;
+	std::size_t		_outputOffset;
+	bool			_lastCluster;
 	unsigned long	_indexToStream;
 	unsigned long	_blockNum;
-	unsigned long	_roundNum;
 	unsigned long	_clusterNum;
 	std::size_t		_inputSize;
+	std::size_t		_clusterBytes;
 	Block			_baseKey;
 	Block			_lastBlockPrevCluster;
-	Block *			_currentBlock;
-	LRSide *		_currentL;
-	LRSide *		_currentR;
+	CipherMode		_cipherMode;		// setCipherMode, for encrypt()
+	CipherMode		_fileMode;			// Mode of the file being worked on
+	Block			_fileIV;			// Its IV, XEX mixes it into every cluster tweak
+	unsigned int	_threads;
+	KeySchedule		_keySchedule;
 	std::vector<Block> _currentBlockSet;
+	ClusterArena	_arena;
+	HashTree		_clusterHashes;
+	HashTree::Mode	_integrityMode;
+	bool			_writeIndex;		// setIndex, encrypt() ends files in a footer index
+	bool			_inputIndexed;		// The file being decrypted has a footer index
+	std::size_t		_indexClusters;		// Clusters its index lists
+	bool			_collectDigests;	// Encrypting with an index, addClusterHash keeps each cluster's digest
+	std::vector<Block> _clusterDigests;	// The latest, up to INDEX_SPOOL_ENTRIES
+	std::unique_ptr<std::FILE, FileCloser> _indexSpool;	// Index entries of the clusters before them
+	std::size_t		_spooledEntries;
 	
 };
 
@@ -0,0 +1,207 @@
+/*
+ Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+ Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+ Software is provided as is with no guarantees.
+
+
+ Source for WorkerPool class
+ */
+
+#include "WorkerPool.h"
+
+// Public Methods
+
+// Runs task for every index in [0, count) and returns once all of them have finished
+void WorkerPool::parallelFor (std::size_t count, const Task & task)
+{
+	start(count, task, false);
+}
+
+// Same as parallelFor, but index i starts out on worker i % size() and idle workers steal.
+// Indices sorted by decreasing cost spread the biggest tasks over all workers first.
+void WorkerPool::parallelForStealing (std::size_t count, const Task & task)
+{
+	start(count, task, true);
+}
+
+unsigned int WorkerPool::size () const
+{
+	return (unsigned int)_workers.size() + 1;
+}
+
+// Number of hardware threads, at least 1
+unsigned int WorkerPool::defaultThreads ()
+{
+	unsigned int threads = std::thread::hardware_concurrency();
+	return threads ? threads : 1;
+}
+
+// Constructors
+
+WorkerPool::WorkerPool (unsigned int threads)
+{
+	_task = NULL;
+	_count = 0;
+	_nextIndex = 0;
+	_busyWorkers = 0;
+	_generation = 0;
+	_stopping = false;
+	_stealing = false;
+
+	// The calling thread is worker 0
+	for (unsigned int i = 0; i < threads || i == 0; i++)
+		_deques.push_back(std::unique_ptr<WorkDeque> (new WorkDeque));
+	for (unsigned int i = 1; i < threads; i++)
+		_workers.push_back(std::thread(&WorkerPool::workerLoop, this, i));
+}
+
+WorkerPool::~WorkerPool ()
+{
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_stopping = true;
+	}
+	_wake.notify_all();
+
+	for (std::size_t i = 0; i < _workers.size(); i++)
+		_workers[i].join();
+}
+
+// Private Methods
+
+// Hands count tasks to every worker and runs its share on the calling thread, returning once all have finished.
+// Rethrows the first exception a task threw, only after every worker is idle again.
+void WorkerPool::start (std::size_t count, const Task & task, bool stealing)
+{
+	if (count == 0)
+		return;
+
+	// Nothing to hand out, run inline
+	if (_workers.empty() || count == 1)
+	{
+		for (std::size_t i = 0; i < count; i++)
+			task(i, 0);
+		return;
+	}
+
+	// Workers are all parked, so their deques can be filled without locking
+	if (stealing)
+		for (std::size_t i = 0; i < count; i++)
+			_deques[i % _deques.size()]->indices.push_back(i);
+
+	{
+		std::lock_guard<std::mutex> lock (_mutex);
+		_task = &task;
+		_count = count;
+		_nextIndex = 0;
+		_stealing = stealing;
+		_busyWorkers = (unsigned int)_workers.size();
+		_generation++;
+	}
+	_wake.notify_all();
+
+	// Calling thread works too
+	runTasks(0);
+
+	// Wait for the workers to drain, so task can go out of scope after return
+	std::exception_ptr error;
+	{
+		std::unique_lock<std::mutex> lock (_mutex);
+		_done.wait(lock, [this] { return _busyWorkers == 0; });
+		_task = NULL;
+		error = _error;
+		_error = NULL;
+	}
+
+	if (error)
+	{
+		// Workers that threw left their indices behind, which must not leak into the next start
+		for (std::size_t i = 0; i < _deques.size(); i++)
+			_deques[i]->indices.clear();
+		std::rethrow_exception(error);
+	}
+}
+
+void WorkerPool::workerLoop (unsigned int worker)
+{
+	unsigned long seenGeneration = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock (_mutex);
+			_wake.wait(lock, [&] { return _stopping || _generation != seenGeneration; });
+			if (_stopping)
+				return;
+			seenGeneration = _generation;
+		}
+
+		runTasks(worker);
+
+		std::lock_guard<std::mutex> lock (_mutex);
+		if (--_busyWorkers == 0)
+			_done.notify_one();
+	}
+}
+
+// Claims and runs task indices until none are left, or until one throws.
+// The exception is kept for start rather than let out, where it would end a worker thread and the process.
+void WorkerPool::runTasks (unsigned int worker)
+{
+	try
+	{
+		if (_stealing)
+		{
+			runStolenTasks(worker);
+			return;
+		}
+
+		for (std::size_t i = _nextIndex++; i < _count; i = _nextIndex++)
+			(*_task)(i, worker);
+	}
+
+	catch (...) {
+		std::lock_guard<std::mutex> lock (_mutex);
+		if (!_error)
+			_error = std::current_exception();
+	}
+}
+
+// Runs the worker's own indices, then steals from the other deques until every one is empty.
+// No index is added once the tasks start, so a worker that finds them all empty is done.
+void WorkerPool::runStolenTasks (unsigned int worker)
+{
+	std::size_t index;
+	while (takeIndex(worker, index))
+		(*_task)(index, worker);
+}
+
+// Pops the front of the worker's own deque, or else the back of the first non empty one after it
+bool WorkerPool::takeIndex (unsigned int worker, std::size_t & index)
+{
+	{
+		WorkDeque & own = *_deques[worker];
+		std::lock_guard<std::mutex> lock (own.mutex);
+		if (!own.indices.empty())
+		{
+			index = own.indices.front();
+			own.indices.pop_front();
+			return true;
+		}
+	}
+
+	for (std::size_t i = 1; i < _deques.size(); i++)
+	{
+		WorkDeque & victim = *_deques[(worker + i) % _deques.size()];
+		std::lock_guard<std::mutex> lock (victim.mutex);
+		if (!victim.indices.empty())
+		{
+			index = victim.indices.back();
+			victim.indices.pop_back();
+			return true;
+		}
+	}
+
+	return false;
+}
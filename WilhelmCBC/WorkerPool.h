@@ -0,0 +1,93 @@
+/*
+	Released under Creative Commons - creativecommons.org/licenses/by-nc-sa/3.0/
+	Attribution-NonCommercial-ShareAlike 3.0 Unported (CC BY-NC-SA 3.0)
+
+	Software is provided as is with no guarantees.
+
+
+	Header for WorkerPool class
+
+	Fixed set of worker threads used by WilhelmCBC to spread independent clusters over all cores.
+	The calling thread takes part in the work, so a pool of size 1 runs everything inline.
+
+	parallelFor hands out indices in order from one shared counter, which suits many equal sized tasks.
+	parallelForStealing deals the indices round robin onto a deque per worker instead. Workers take from the
+	front of their own deque and, once it is empty, steal from the back of the others', which keeps them
+	balanced when task sizes vary widely (whole files, for TreeCipher).
+
+	Usage:
+	********************************
+	WorkerPool pool (threads);
+	pool.parallelFor (count, task);	// task (index, worker) for every index in [0, count), blocks until done
+	pool.parallelForStealing (count, task);
+	********************************
+
+	A task that throws stops the worker it ran on. The rest still drain, and once every worker is idle
+	the first exception thrown is rethrown to the caller.
+*/
+
+#ifndef __WilhelmCBC__WorkerPool__
+#define __WilhelmCBC__WorkerPool__
+
+#include <vector>				// std::vector
+#include <deque>				// std::deque
+#include <memory>				// std::unique_ptr
+#include <thread>				// std::thread
+#include <mutex>				// std::mutex
+#include <condition_variable>	// std::condition_variable
+#include <atomic>				// std::atomic
+#include <functional>			// std::function
+#include <exception>			// std::exception_ptr
+
+class WorkerPool {
+public:
+// Types
+	// Task, called with the work item index and the index of the worker running it (0 is the calling thread).
+	typedef std::function<void (std::size_t index, unsigned int worker)> Task;
+
+// Public Methods
+	void parallelFor (std::size_t count, const Task & task);
+	void parallelForStealing (std::size_t count, const Task & task);
+	unsigned int size () const;
+
+	static unsigned int defaultThreads ();
+
+// Constructors
+	explicit WorkerPool (unsigned int threads);
+	~WorkerPool ();
+
+private:
+// Types
+	// WorkDeque, the indices one worker owns in parallelForStealing
+	struct WorkDeque {
+		std::mutex				mutex;
+		std::deque<std::size_t>	indices;
+	};
+
+// Private Methods
+	void start (std::size_t count, const Task & task, bool stealing);
+	void workerLoop (unsigned int worker);
+	void runTasks (unsigned int worker);
+	void runStolenTasks (unsigned int worker);
+	bool takeIndex (unsigned int worker, std::size_t & index);
+
+	WorkerPool (const WorkerPool &);
+	WorkerPool & operator= (const WorkerPool &);
+
+// Private Data Members
+	std::vector<std::thread>	_workers;
+	std::mutex					_mutex;
+	std::condition_variable		_wake;
+	std::condition_variable		_done;
+	const Task *				_task;
+	std::size_t					_count;
+	std::atomic<std::size_t>	_nextIndex;
+	unsigned int				_busyWorkers;
+	unsigned long				_generation;
+	bool						_stopping;
+	bool						_stealing;
+	std::vector<std::unique_ptr<WorkDeque> >	_deques;	// One per worker, worker 0 included
+	std::exception_ptr			_error;		// First exception a task threw, rethrown by start
+};
+
+#endif /* defined(__WilhelmCBC__WorkerPool__) */
@@ -20,23 +20,394 @@
  */
 
 #include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
 #include <stdexcept>
 #include "WilhelmCBC.h"
+#include "TreeCipher.h"
 #include "NetRunlib.h"
 
+// Plaintext bytes for --range
+struct ByteRange {
+    std::size_t offset;
+    std::size_t length;
+};
+
 // Function Prototypes
 void menu();
-void timePrint (double time1, double time2, int dataSize);
+int  commandLine (int argc, const char * argv[]);
+void usage ();
+bool readKeyFile (const std::string & path, std::string & keyPhrase);
+bool readManifest (const std::string & path, std::vector<std::pair<std::string, std::string> > & jobs);
+bool parseRange (const std::string & text, ByteRange & range);
+bool runJob (WilhelmCBC & cipherObj, bool encrypting, const std::string & input, const std::string & output, bool timed,
+             const ByteRange * range = NULL);
+int  runTree (const std::string & keyPhrase, bool encrypting, const std::string & inputRoot, const std::string & outputRoot,
+              std::size_t clusterBytes, unsigned int threads, WilhelmCBC::IOBackend backend, bool indexed,
+              WilhelmCBC::CipherMode mode, HashTree::Mode integrity);
+void timePrint (double time1, double time2, double dataSize, std::ostream & out = std::cout);
 
 enum BYTES {BYTES = 0, KILOBYTES = 1, MEGABYTES = 2, GIGABYTES = 3};
 
+const char * const DEFAULT_KEY_ENV = "WILHELMCBC_KEY";
+
 
 int main(int argc, const char * argv[])
 {
+	// Any arguments run the command line interface, none the interactive menu
+	if (argc > 1)
+		return commandLine(argc, argv);
+
 	// Call the menu wrapper
 	menu();
 }
 
+int commandLine (int argc, const char * argv[])
+{
+    /*
+     Non-interactive interface, for scripts. See usage() for the arguments.
+     
+     The passphrase comes from a key file or an environment variable, never the command line,
+     and is hashed into a key once. A manifest runs every one of its jobs on that one key.
+     --recursive takes two directories and hands the tree to runTree.
+     --range decrypts only part of each file, see WilhelmCBC::decryptRange.
+     
+     Returns 0 if every file was processed (and decrypted files matched their HMAC), 1 if any failed,
+     2 for bad arguments.
+     */
+    
+    if (argc < 2 || (strcmp(argv[1], "encrypt") && strcmp(argv[1], "decrypt")))
+    {
+        usage();
+        return 2;
+    }
+    bool encrypting = !strcmp(argv[1], "encrypt");
+    
+    std::string keyFile;
+    std::string keyEnv = DEFAULT_KEY_ENV;
+    std::string manifest;
+    std::vector<std::string> paths;
+    bool timed = false;
+    bool recursive = false;
+    bool ranged = false;
+    bool indexed = false;
+    WilhelmCBC::CipherMode mode = WilhelmCBC::MODE_CBC;
+    HashTree::Mode integrity = HashTree::MERKLE;
+    ByteRange range = ByteRange();
+    std::size_t clusterBytes = CLUSTER_BYTES;
+    unsigned int threads = WorkerPool::defaultThreads();
+    WilhelmCBC::IOBackend backend = WilhelmCBC::IO_MAPPED;
+    
+    WilhelmCBC cipherObj;
+    
+    try
+    {
+        for (int i = 2; i < argc; i++)
+        {
+            std::string arg = argv[i];
+            bool hasValue = (i+1 < argc);
+            
+            if ((arg == "-k" || arg == "--key-file") && hasValue)
+                keyFile = argv[++i];
+            else if ((arg == "-e" || arg == "--key-env") && hasValue)
+                keyEnv = argv[++i];
+            else if ((arg == "-m" || arg == "--manifest") && hasValue)
+                manifest = argv[++i];
+            else if ((arg == "-c" || arg == "--cluster-size") && hasValue)
+            {
+                clusterBytes = strtoul(argv[++i], NULL, 10);
+                cipherObj.setClusterSize(clusterBytes);
+            }
+            else if ((arg == "-j" || arg == "--threads") && hasValue)
+            {
+                threads = (unsigned int)strtoul(argv[++i], NULL, 10);
+                cipherObj.setThreads(threads);
+            }
+            else if (arg == "--io" && hasValue)
+            {
+                std::string backendName = argv[++i];
+                if (backendName == "mapped")
+                    backend = WilhelmCBC::IO_MAPPED;
+                else if (backendName == "uring")
+                    backend = WilhelmCBC::IO_URING;
+                else if (backendName == "stream")
+                    backend = WilhelmCBC::IO_STREAM;
+                else
+                    throw std::runtime_error ("UNKNOWN IO BACKEND " + backendName);
+                cipherObj.setIOBackend(backend);
+            }
+            else if (arg == "--range" && hasValue)
+            {
+                if (!parseRange(argv[++i], range))
+                    throw std::runtime_error ("BAD RANGE " + std::string(argv[i]));
+                ranged = true;
+            }
+            else if (arg == "--mode" && hasValue)
+            {
+                std::string modeName = argv[++i];
+                if (modeName == "cbc")
+                    mode = WilhelmCBC::MODE_CBC;
+                else if (modeName == "xex")
+                    mode = WilhelmCBC::MODE_XEX;
+                else
+                    throw std::runtime_error ("UNKNOWN MODE " + modeName);
+                cipherObj.setCipherMode(mode);
+            }
+            else if (arg == "--integrity" && hasValue)
+            {
+                std::string integrityName = argv[++i];
+                if (integrityName == "merkle")
+                    integrity = HashTree::MERKLE;
+                else if (integrityName == "flat")
+                    integrity = HashTree::FLAT;
+                else
+                    throw std::runtime_error ("UNKNOWN INTEGRITY MODE " + integrityName);
+                cipherObj.setIntegrityMode(integrity);
+            }
+            else if (arg == "--index")
+            {
+                indexed = true;
+                cipherObj.setIndex(true);
+            }
+            else if (arg == "-r" || arg == "--recursive")
+                recursive = true;
+            else if (arg == "--time")
+                timed = true;
+            else if (arg == "-h" || arg == "--help")
+            {
+                usage();
+                return 0;
+            }
+            else if (arg.size() > 1 && arg[0] == '-')
+                throw std::runtime_error ("UNKNOWN OPTION " + arg);
+            else
+                paths.push_back(arg);
+        }
+    }
+    catch (std::runtime_error & e) {
+        std::cerr << e.what() << "\n";
+        usage();
+        return 2;
+    }
+    
+    // Jobs, from the manifest or the two paths given
+    std::vector<std::pair<std::string, std::string> > jobs;
+    if (ranged && (encrypting || recursive))
+    {
+        usage();
+        return 2;
+    }
+    else if (recursive && manifest.empty() && paths.size() == 2)
+    {
+        // Directories, handled by runTree
+    }
+    else if (!manifest.empty() && paths.empty())
+    {
+        if (!readManifest(manifest, jobs))
+            return 2;
+    }
+    else if (manifest.empty() && paths.size() == 2 && !recursive)
+        jobs.push_back(std::make_pair(paths[0], paths[1]));
+    else
+    {
+        usage();
+        return 2;
+    }
+    
+    // Passphrase, from the key file if given, otherwise the environment
+    std::string keyPhrase;
+    if (!keyFile.empty())
+    {
+        if (!readKeyFile(keyFile, keyPhrase))
+            return 2;
+    }
+    else if (getenv(keyEnv.c_str()))
+        keyPhrase = getenv(keyEnv.c_str());
+    
+    if (keyPhrase.empty())
+    {
+        std::cerr << "NO PASSPHRASE - use --key-file, or set " << keyEnv << "\n";
+        return 2;
+    }
+    
+    if (recursive)
+        return runTree(keyPhrase, encrypting, paths[0], paths[1], clusterBytes, threads, backend, indexed, mode, integrity);
+    
+    // Derived once, every job reuses it
+    cipherObj.setKey(keyPhrase);
+    
+    int failures = 0;
+    for (std::size_t i = 0; i < jobs.size(); i++)
+        if (!runJob(cipherObj, encrypting, jobs[i].first, jobs[i].second, timed, ranged ? &range : NULL))
+            failures++;
+    
+    if (failures && jobs.size() > 1)
+        std::cerr << failures << " of " << jobs.size() << " files failed\n";
+    
+    return failures ? 1 : 0;
+}
+
+void usage ()
+{
+    std::cerr
+    << "Usage:\n"
+    << "  wcbc                                   interactive menu\n"
+    << "  wcbc encrypt|decrypt [options] INPUT OUTPUT\n"
+    << "  wcbc encrypt|decrypt [options] --manifest FILE\n"
+    << "  wcbc encrypt|decrypt [options] --recursive INPUT_DIRECTORY OUTPUT_DIRECTORY\n"
+    << "\n"
+    << "INPUT or OUTPUT may be - for stdin or stdout.\n"
+    << "\n"
+    << "Options:\n"
+    << "  -k, --key-file FILE       passphrase is the first line of FILE\n"
+    << "  -e, --key-env NAME        passphrase is in environment variable NAME (default " << DEFAULT_KEY_ENV << ")\n"
+    << "  -m, --manifest FILE       one job per line: INPUT<tab>OUTPUT. Blank lines and lines starting with # are skipped\n"
+    << "  -r, --recursive           every file under INPUT_DIRECTORY, to the same path under OUTPUT_DIRECTORY\n"
+    << "  -c, --cluster-size BYTES  cluster size to encrypt with, a multiple of 4096\n"
+    << "  -j, --threads N           threads to decrypt (or encrypt with --mode xex) with, or to work through a tree with\n"
+    << "      --io mapped|uring|stream  how regular files are read and written\n"
+    << "      --mode cbc|xex        how blocks are chained when encrypting. xex encrypts clusters in parallel\n"
+    << "                            (default cbc, decrypt reads the mode from the file)\n"
+    << "      --integrity merkle|flat  how the cluster hashes are combined into the file hash when encrypting.\n"
+    << "                            merkle hashes them as a tree, flat in one pass\n"
+    << "                            (default merkle, decrypt reads it from the file)\n"
+    << "      --index               end encrypted files in an index of every cluster's offset and digest\n"
+    << "                            (32 bytes a cluster, past the first 4096 clusters held in a temporary file\n"
+    << "                            until the file is done)\n"
+    << "      --range OFFSET:LENGTH decrypt only LENGTH bytes of plaintext from OFFSET, reading just the clusters\n"
+    << "                            that hold them. INPUT must be seekable. The file hash is not checked,\n"
+    << "                            only each cluster's digest, if the file has an index\n"
+    << "      --time                print each file's throughput to stderr\n";
+}
+
+bool readKeyFile (const std::string & path, std::string & keyPhrase)
+{
+    /*
+     Reads the passphrase, the first line of the file, the same as typed at the menu prompt.
+     A trailing carriage return is dropped.
+     */
+    
+    std::ifstream keyFile (path.c_str());
+    if (!keyFile.is_open())
+    {
+        std::cerr << "Could not open key file " << path << "\n";
+        return false;
+    }
+    
+    std::getline(keyFile, keyPhrase);
+    if (!keyPhrase.empty() && keyPhrase[keyPhrase.size()-1] == '\r')
+        keyPhrase.erase(keyPhrase.size()-1);
+    
+    return true;
+}
+
+bool readManifest (const std::string & path, std::vector<std::pair<std::string, std::string> > & jobs)
+{
+    /*
+     Reads a manifest of jobs, one per line as input path, tab, output path.
+     Blank lines and lines starting with # are skipped. Any other line without a tab is an error,
+     reported before any file is touched.
+     */
+    
+    std::ifstream manifestFile (path.c_str());
+    if (!manifestFile.is_open())
+    {
+        std::cerr << "Could not open manifest " << path << "\n";
+        return false;
+    }
+    
+    std::string line;
+    for (unsigned long lineNum = 1; std::getline(manifestFile, line); lineNum++)
+    {
+        if (!line.empty() && line[line.size()-1] == '\r')
+            line.erase(line.size()-1);
+        if (line.empty() || line[0] == '#')
+            continue;
+        
+        std::size_t tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0 || tab+1 == line.size())
+        {
+            std::cerr << path << ":" << lineNum << ": expected INPUT<tab>OUTPUT\n";
+            return false;
+        }
+        jobs.push_back(std::make_pair(line.substr(0, tab), line.substr(tab+1)));
+    }
+    
+    return true;
+}
+
+bool parseRange (const std::string & text, ByteRange & range)
+{
+    /*
+     Reads OFFSET:LENGTH, both in bytes. Returns false if either is missing or not a number.
+     */
+    
+    std::size_t colon = text.find(':');
+    if (colon == std::string::npos || colon == 0 || colon+1 == text.size())
+        return false;
+    
+    char * end;
+    range.offset = strtoull(text.c_str(), &end, 10);
+    if (end != text.c_str()+colon)
+        return false;
+    range.length = strtoull(text.c_str()+colon+1, &end, 10);
+    return *end == '\0' && text[0] != '-' && text[colon+1] != '-';
+}
+
+bool runJob (WilhelmCBC & cipherObj, bool encrypting, const std::string & input, const std::string & output, bool timed,
+             const ByteRange * range)
+{
+    /*
+     Encrypts or decrypts one file with the key already set in cipherObj, or just a range of it when decrypting.
+     Errors are reported to stderr, stdout may be the output. Returns false on any error or HMAC mismatch.
+     */
+    
+    try
+    {
+        double t1 = time_in_seconds();
+        
+        cipherObj.setInput (input == "-" ? "/dev/stdin" : input);
+        cipherObj.setOutput (output == "-" ? "/dev/stdout" : output);
+        
+        bool success = true;
+        double bytes;
+        if (range)
+            bytes = (double)cipherObj.decryptRange(range->offset, range->length);
+        else if (encrypting)
+            cipherObj.encrypt();
+        else
+            success = cipherObj.decrypt();
+        
+        double t2 = time_in_seconds();
+        
+        if (!range)
+            bytes = (double)cipherObj.getSize();
+        if (timed)
+        {
+            std::cerr << input << ":";
+            timePrint (t1, t2, bytes, std::cerr);
+        }
+        
+        if (!success)
+            std::cerr << input << ": Unsuccessful decryption - HMAC failed\n";
+        return success;
+    }
+    
+    catch (std::runtime_error & e) {
+        std::cerr << input << ": " << e.what() << "\n";
+    }
+    
+    catch (std::bad_alloc & e) {
+        std::cerr << input << ": Allocation Error - Sufficient memory might not be available. " << e.what() << "\n";
+    }
+    
+    return false;
+}
+
 void menu ()
 {
     /*
@@ -173,10 +544,49 @@ void menu ()
 }
 
 
-void timePrint (double time1, double time2, int dataSize)
+int runTree (const std::string & keyPhrase, bool encrypting, const std::string & inputRoot, const std::string & outputRoot,
+             std::size_t clusterBytes, unsigned int threads, WilhelmCBC::IOBackend backend, bool indexed,
+             WilhelmCBC::CipherMode mode, HashTree::Mode integrity)
+{
+    /*
+     Encrypts or decrypts a whole directory tree with a TreeCipher, then prints how many files were
+     processed and the aggregate throughput over all of them to stderr.
+     
+     Returns 0 if every file succeeded, 1 otherwise.
+     */
+    
+    try
+    {
+        TreeCipher tree (keyPhrase, threads);
+        tree.setClusterSize(clusterBytes);
+        tree.setIOBackend(backend);
+        tree.setIndex(indexed);
+        tree.setCipherMode(mode);
+        tree.setIntegrityMode(integrity);
+        
+        double t1 = time_in_seconds();
+        TreeCipher::Totals totals = encrypting ? tree.encrypt(inputRoot, outputRoot, std::cerr)
+                                               : tree.decrypt(inputRoot, outputRoot, std::cerr);
+        double t2 = time_in_seconds();
+        
+        std::cerr << totals.files-totals.failed << " of " << totals.files << " files processed, "
+                  << totals.bytes << " bytes\n";
+        timePrint (t1, t2, (double)totals.bytes, std::cerr);
+        
+        return totals.failed ? 1 : 0;
+    }
+    
+    catch (std::runtime_error & e) {
+        std::cerr << e.what() << "\n";
+    }
+    
+    return 1;
+}
+
+void timePrint (double time1, double time2, double dataSize, std::ostream & out)
 {
     /*
-     Calculates and prints to console the data speed of a given operation.
+     Calculates and prints to console (or out) the data speed of a given operation.
      
      time1 & time2 are the times before and after the operation.
      dataSize is the size (in bytes) of the data operated on.
@@ -221,6 +631,6 @@ void timePrint (double time1, double time2, int dataSize)
             byteUnits = "GB/s";
     }
     
-    std::cout << "\n Processed at an average rate of: " << bytesPerSecond << " " << byteUnits << std::endl << std::endl;
+    out << "\n Processed at an average rate of: " << bytesPerSecond << " " << byteUnits << std::endl << std::endl;
     
 }
\ No newline at end of file